@@ -0,0 +1,121 @@
+#ifndef BUNKERBUILDER_ASSETS_H
+#define BUNKERBUILDER_ASSETS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "game.h"
+
+/**
+ * Packed asset bundle.
+ *
+ * BunkerBuilderBundle decodes every image the game uses into RGBA32 pixels and writes them,
+ * together with the font file, into one file: a header, a table of entries and the data,
+ * each blob aligned to BUNDLE_ALIGNMENT. The game maps the bundle and uploads the pixels
+ * straight into textures - one file open and no decoding, however many assets there are.
+ * Without a bundle the game decodes the individual files instead (see LoadTextures()).
+ */
+
+namespace bb {
+
+using namespace std;
+
+const char ASSET_BUNDLE_MAGIC[4] = {'B', 'B', 'A', 'B'};
+const uint32_t ASSET_BUNDLE_VERSION = 1;
+const uint64_t BUNDLE_ALIGNMENT = 64;
+const char *asset_bundle_path = "assets.bundle";
+const char *font_asset = "Katibeh-Regular.ttf";
+
+struct BundleHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct BundleEntry {
+  char name[48];
+  uint32_t width, height; // 0 x 0 for files stored as they are
+  uint64_t offset, size;  // from the start of the bundle
+};
+
+// Every image the game loads. The font is stored as a plain file.
+vector<string> ImageAssets() {
+  vector<string> names = {"sky.png", "dwarf.gif", "ground.png", "staircase.png", "corridor.png",
+                          "mushroom_farm.png", "block_selection.png", "btn_corridor.png",
+                          "btn_staircase.png", "btn_mushroom_farm.png"};
+  for (int i = 0; i < NO_ITEM_TYPE; ++i)
+    if (find(names.begin(), names.end(), item_defs[i].texture_name) == names.end())
+      names.push_back(item_defs[i].texture_name); // item types may share a texture
+  return names;
+}
+
+struct AssetBundle {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  const BundleEntry *entries = nullptr;
+  uint32_t count = 0;
+
+  // Fails quietly if there is no bundle - the caller falls back to the individual files.
+  bool Open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(BundleHeader))
+      mapped = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s\n", path);
+      return false;
+    }
+    data = (const uint8_t *) mapped;
+    size = size_t(st.st_size);
+    const BundleHeader *header = (const BundleHeader *) data;
+    entries = (const BundleEntry *) (data + sizeof(BundleHeader));
+    count = header->count;
+    bool valid = memcmp(header->magic, ASSET_BUNDLE_MAGIC, 4) == 0 && header->version == ASSET_BUNDLE_VERSION &&
+                 sizeof(BundleHeader) + uint64_t(count) * sizeof(BundleEntry) <= size;
+    for (uint32_t i = 0; valid && i < count; ++i) {
+      const BundleEntry &e = entries[i];
+      valid = e.offset <= size && e.size <= size - e.offset && e.name[sizeof(e.name) - 1] == 0 &&
+              (e.width == 0 || uint64_t(e.width) * e.height * 4 == e.size);
+    }
+    if (!valid) {
+      fprintf(stderr, "%s is not an asset bundle of version %u - rebuild it\n", path, ASSET_BUNDLE_VERSION);
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (data) munmap((void *) data, size);
+    data = nullptr;
+    entries = nullptr;
+    size = count = 0;
+  }
+
+  const BundleEntry *Find(const string &name) const {
+    for (uint32_t i = 0; i < count; ++i)
+      if (name == entries[i].name) return &entries[i];
+    return nullptr;
+  }
+
+  const uint8_t *Data(const BundleEntry &entry) const {
+    return data + entry.offset;
+  }
+};
+
+AssetBundle asset_bundle;
+
+}
+
+#endif //BUNKERBUILDER_ASSETS_H
@@ -0,0 +1,49 @@
+#ifndef BUNKERBUILDER_BATCH_H
+#define BUNKERBUILDER_BATCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "game.h"
+#include "trace.h"
+
+/**
+ * Batch simulation of many independent worlds.
+ *
+ * Worlds are handed out to worker threads one at a time, so a slow world doesn't hold the
+ * others up. Tick() only touches its own World (plus thread-safe profiling), which is what
+ * makes this safe. Seed each world with a stream split off one generator (SeedWorlds) and
+ * the whole batch is reproducible from a single seed.
+ */
+
+namespace bb {
+
+using namespace std;
+
+void SeedWorlds(const vector<World *> &worlds, uint64_t seed) {
+  random::Rng master(seed);
+  for (World *w : worlds) w->rng = master.Split();
+}
+
+void RunWorlds(const vector<World *> &worlds, int64_t ticks, unsigned threads = 0) {
+  if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+  threads = (unsigned) min<size_t>(threads, worlds.size());
+  atomic<size_t> next{0};
+  auto worker = [&]() {
+    TraceThreadName("batch worker");
+    for (size_t i; (i = next.fetch_add(1)) < worlds.size();) {
+      World &w = *worlds[i];
+      TraceScope trace("world");
+      for (int64_t t = 0; t < ticks; ++t) Tick(w);
+    }
+  };
+  vector<thread> pool;
+  for (unsigned i = 0; i < threads; ++i) pool.emplace_back(worker);
+  for (thread &t : pool) t.join();
+}
+
+}
+
+#endif //BUNKERBUILDER_BATCH_H
@@ -0,0 +1,134 @@
+// Asset packer - decodes the game's images and writes them with the font into one bundle.
+//
+//   BunkerBuilderBundle <output> [asset directory]
+//
+// The game picks up assets.bundle from its working directory (see assets.h).
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#include "assets.h"
+
+using namespace std;
+using namespace bb;
+
+struct Blob {
+  BundleEntry entry;
+  vector<uint8_t> bytes;
+};
+
+bool AddEntry(vector<Blob> &blobs, const string &name, uint32_t width, uint32_t height) {
+  if (name.size() >= sizeof(BundleEntry::name)) {
+    fprintf(stderr, "Asset name too long: %s\n", name.c_str());
+    return false;
+  }
+  blobs.emplace_back();
+  BundleEntry &e = blobs.back().entry;
+  memset(&e, 0, sizeof(e));
+  strcpy(e.name, name.c_str());
+  e.width = width;
+  e.height = height;
+  return true;
+}
+
+bool AddImage(vector<Blob> &blobs, const string &dir, const string &name) {
+  SDL_Surface *loaded = IMG_Load((dir + name).c_str());
+  if (loaded == nullptr) {
+    fprintf(stderr, "Failed to load %s: %s\n", name.c_str(), IMG_GetError());
+    return false;
+  }
+  SDL_Surface *rgba = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+  SDL_FreeSurface(loaded);
+  if (rgba == nullptr) {
+    fprintf(stderr, "Failed to convert %s: %s\n", name.c_str(), SDL_GetError());
+    return false;
+  }
+  if (!AddEntry(blobs, name, rgba->w, rgba->h)) {
+    SDL_FreeSurface(rgba);
+    return false;
+  }
+  // Rows are stored without padding.
+  vector<uint8_t> &bytes = blobs.back().bytes;
+  size_t row = size_t(rgba->w) * 4;
+  bytes.resize(row * rgba->h);
+  SDL_LockSurface(rgba);
+  for (int y = 0; y < rgba->h; ++y)
+    memcpy(&bytes[y * row], (const uint8_t *) rgba->pixels + y * rgba->pitch, row);
+  SDL_UnlockSurface(rgba);
+  SDL_FreeSurface(rgba);
+  return true;
+}
+
+bool AddFile(vector<Blob> &blobs, const string &dir, const string &name) {
+  FILE *f = fopen((dir + name).c_str(), "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s\n", name.c_str());
+    return false;
+  }
+  if (!AddEntry(blobs, name, 0, 0)) {
+    fclose(f);
+    return false;
+  }
+  vector<uint8_t> &bytes = blobs.back().bytes;
+  uint8_t buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) bytes.insert(bytes.end(), buffer, buffer + n);
+  fclose(f);
+  return true;
+}
+
+bool WriteBundle(const string &path, vector<Blob> &blobs) {
+  uint64_t offset = sizeof(BundleHeader) + blobs.size() * sizeof(BundleEntry);
+  for (Blob &b : blobs) {
+    offset = (offset + BUNDLE_ALIGNMENT - 1) / BUNDLE_ALIGNMENT * BUNDLE_ALIGNMENT;
+    b.entry.offset = offset;
+    b.entry.size = b.bytes.size();
+    offset += b.entry.size;
+  }
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    return false;
+  }
+  BundleHeader header = {};
+  memcpy(header.magic, ASSET_BUNDLE_MAGIC, 4);
+  header.version = ASSET_BUNDLE_VERSION;
+  header.count = (uint32_t) blobs.size();
+  fwrite(&header, sizeof(header), 1, f);
+  for (Blob &b : blobs) fwrite(&b.entry, sizeof(b.entry), 1, f);
+  static const uint8_t padding[BUNDLE_ALIGNMENT] = {};
+  uint64_t written = sizeof(BundleHeader) + blobs.size() * sizeof(BundleEntry);
+  for (Blob &b : blobs) {
+    fwrite(padding, 1, size_t(b.entry.offset - written), f);
+    fwrite(b.bytes.data(), 1, b.bytes.size(), f);
+    written = b.entry.offset + b.entry.size;
+  }
+  bool ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "Failed to write %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <output> [asset directory]\n", argv[0]);
+    return 1;
+  }
+  string dir = argc > 2 ? string(argv[2]) + "/" : "";
+  IMG_Init(IMG_INIT_PNG);
+  vector<Blob> blobs;
+  for (const string &name : ImageAssets())
+    if (!AddImage(blobs, dir, name))
+      return 1;
+  if (!AddFile(blobs, dir, font_asset))
+    return 1;
+  if (!WriteBundle(argv[1], blobs))
+    return 1;
+  IMG_Quit();
+  return 0;
+}
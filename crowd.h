@@ -0,0 +1,83 @@
+#ifndef BUNKERBUILDER_CROWD_H
+#define BUNKERBUILDER_CROWD_H
+
+#include <cstdint>
+#include <vector>
+#include "utils.h"
+
+/**
+ * Uniform grid over dwarf positions for neighbour queries.
+ *
+ * The world is unbounded, so grid cells are hashed into a table of buckets sized to the
+ * population, and the points are counting-sorted by bucket - Build() is O(n) and doesn't
+ * allocate once the vectors have grown. A query visits the 3 x 3 grid cells around a point;
+ * points of other grid cells that share a bucket come along too, so callers check the
+ * distance themselves.
+ */
+
+namespace bb {
+
+using namespace std;
+
+struct GridPoint {
+  int y, x;
+};
+
+struct DwarfGrid {
+  int cell_w = 1, cell_h = 1;
+  uint32_t mask = 0;
+  vector<GridPoint> points;
+  vector<int32_t> starts; // bucket b holds order[starts[b] .. starts[b + 1])
+  vector<int32_t> order;  // indices into `points`
+  vector<uint32_t> buckets;
+
+  uint32_t Bucket(int gy, int gx) const {
+    uint64_t h = (uint64_t(uint32_t(gy)) << 32 | uint32_t(gx)) * 0x9E3779B97F4A7C15ull;
+    return uint32_t(h >> 32) & mask;
+  }
+
+  // Indexes `points`, which the caller has filled in.
+  void Build(int grid_cell_w, int grid_cell_h) {
+    cell_w = grid_cell_w;
+    cell_h = grid_cell_h;
+    uint32_t size = 64;
+    while (size < 2 * points.size()) size *= 2;
+    mask = size - 1;
+    starts.assign(size + 1, 0);
+    buckets.resize(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+      buckets[i] = Bucket(div_floor(points[i].y, cell_h), div_floor(points[i].x, cell_w));
+      ++starts[buckets[i]];
+    }
+    // starts[b] = end of bucket b, then filling back to front moves it to the bucket's start
+    // and keeps each bucket's points in their original order.
+    for (uint32_t b = 1; b < size; ++b) starts[b] += starts[b - 1];
+    starts[size] = int32_t(points.size());
+    order.resize(points.size());
+    for (size_t i = points.size(); i-- > 0;) order[--starts[buckets[i]]] = int32_t(i);
+  }
+
+  // Calls f(index) for every point in the grid cells around `p` (and maybe a few others),
+  // until f returns false.
+  template<class F>
+  void ForEachNear(const GridPoint &p, F f) const {
+    int gy = div_floor(p.y, cell_h), gx = div_floor(p.x, cell_w);
+    uint32_t visited[9];
+    int visited_count = 0;
+    for (int y = gy - 1; y <= gy + 1; ++y) {
+      for (int x = gx - 1; x <= gx + 1; ++x) {
+        uint32_t b = Bucket(y, x);
+        bool seen = false;
+        for (int i = 0; i < visited_count; ++i) seen |= visited[i] == b;
+        if (seen) continue;
+        visited[visited_count++] = b;
+        for (int32_t i = starts[b]; i < starts[b + 1]; ++i)
+          if (!f(order[i])) return;
+      }
+    }
+  }
+};
+
+}
+
+#endif //BUNKERBUILDER_CROWD_H
@@ -0,0 +1,70 @@
+#ifndef BUNKERBUILDER_EVENTS_H
+#define BUNKERBUILDER_EVENTS_H
+
+#include <vector>
+
+/**
+ * Deferred event bus.
+ *
+ * The simulation posts small fixed-size records and the bus hands them to subscribers in one
+ * batch - at the end of Tick() and after each world command. Subscribers are plain function
+ * pointers with a context pointer, registered once per event type. Records of types nobody
+ * listens to aren't even queued, and the queue keeps its capacity between batches, so
+ * posting doesn't allocate once the game is running.
+ */
+
+namespace bb {
+
+using namespace std;
+
+struct World;
+
+enum EventType {
+  EVENT_DWARF_CREATED = 0,
+  EVENT_DWARF_SAID,
+  EVENT_DWARF_SPEECH_ENDED, // the oldest thing the dwarf said is no longer shown
+  EVENT_TYPE_COUNT
+};
+
+struct WorldEvent {
+  EventType type;
+  int dwarf_id;
+  const char *text; // EVENT_DWARF_SAID - points to a string literal, never copied
+};
+
+typedef void (*EventHandler)(World &w, const WorldEvent &event, void *context);
+
+struct EventBus {
+  struct Subscriber {
+    EventHandler handler;
+    void *context;
+  };
+
+  vector<WorldEvent> queue;
+  vector<Subscriber> subscribers[EVENT_TYPE_COUNT];
+
+  void Subscribe(EventType type, EventHandler handler, void *context = nullptr) {
+    subscribers[type].push_back(Subscriber{handler, context});
+  }
+
+  bool HasSubscribers(EventType type) const {
+    return !subscribers[type].empty();
+  }
+
+  void Post(const WorldEvent &event) {
+    if (!subscribers[event.type].empty()) queue.push_back(event);
+  }
+
+  void Dispatch(World &w) {
+    // Handlers may post more events - those go out in the same batch.
+    for (size_t i = 0; i < queue.size(); ++i) {
+      WorldEvent event = queue[i];
+      for (const Subscriber &s : subscribers[event.type]) s.handler(w, event, s.context);
+    }
+    queue.clear();
+  }
+};
+
+}
+
+#endif //BUNKERBUILDER_EVENTS_H
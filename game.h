@@ -1,16 +1,30 @@
 #ifndef BUNKERBUILDER_GAME_H
 #define BUNKERBUILDER_GAME_H
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
+#include <queue>
 #include <set>
 #include <deque>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <array>
 #include "utils.h"
+#include "profiler.h"
+#include "memory.h"
+#include "telemetry.h"
+#include "random.h"
+#include "namegen.h"
+#include "events.h"
+#include "timers.h"
+#include "crowd.h"
+#include "paging.h"
 
 /**
  * Each cell is able to hold arbitrary number of small items.
@@ -29,8 +43,6 @@ using namespace std;
 constexpr int W = 100;
 constexpr int H = 200;
 
-int money = 1000000;
-
 enum StructureType {
   NONE = 0,
   STAIRCASE,
@@ -40,42 +52,14 @@ enum StructureType {
 
 struct Dwarf;
 
-struct Structure {
+struct Structure : Tracked<MEMORY_STRUCTURES> {
   StructureType type;
   Dwarf *assignee = nullptr;
+  int32_t workshop = -1; // slot in the WorkshopLane of the structure's recipe
 
   static Structure *New(StructureType);
 };
 
-struct Staircase : Structure {
-};
-
-struct Corridor : Structure {
-};
-
-struct MushroomFarm : Structure {
-};
-
-Structure *Structure::New(StructureType type) {
-  Structure *s;
-  switch (type) {
-    case STAIRCASE:
-      s = new Staircase();
-      break;
-    case CORRIDOR:
-      s = new Corridor();
-      break;
-    case MUSHROOM_FARM:
-      s = new MushroomFarm();
-      break;
-    default:
-      fprintf(stderr, "Unknown structure type: %d\n", type);
-      return nullptr;
-  }
-  s->type = type;
-  return s;
-}
-
 struct Point;
 
 struct Cell {
@@ -138,6 +122,7 @@ struct AABB {
 
 enum ItemType {
   SPORE,
+  MUSHROOM,
   NO_ITEM_TYPE,
 };
 
@@ -147,14 +132,81 @@ struct ItemDef {
   string texture_name;
 };
 
-struct Item {
+struct Item : Tracked<MEMORY_ITEMS> {
   Point pos;
+  Cell cell; // key in World::items - a carried item keeps the one it was picked up at
   ItemDef *def;
   Dwarf *assignee;
 };
 
 ItemDef item_defs[] = {
-    [SPORE]={.type = SPORE, .w=27, .h=26, .texture_name = "mushroom.png"}
+    [SPORE]={.type = SPORE, .w=27, .h=26, .texture_name = "mushroom.png"},
+    [MUSHROOM]={.type = MUSHROOM, .w=45, .h=43, .texture_name = "mushroom.png"}
+};
+
+/**
+ * Recipes and workshops.
+ *
+ * A structure whose StructureDef names a recipe is a workshop. Dwarves deliver the recipe's
+ * inputs to it and once its stock covers a batch, the batch runs for `ticks` ticks and drops
+ * the outputs as items in the workshop's cell. The state of all workshops of a recipe lives
+ * in one WorkshopLane, as parallel arrays, and AdvanceProduction() walks every lane once per
+ * tick - adding a workshop or a production chain is a matter of extending the tables.
+ */
+
+enum RecipeType {
+  RECIPE_GROW_MUSHROOMS = 0,
+  RECIPE_COUNT,
+  NO_RECIPE = RECIPE_COUNT
+};
+
+const int RECIPE_SLOTS = 2;
+
+struct RecipeStack {
+  ItemType type;
+  int count; // 0 - unused slot
+};
+
+struct Recipe {
+  const char *name;
+  RecipeStack inputs[RECIPE_SLOTS];
+  RecipeStack outputs[RECIPE_SLOTS];
+  int ticks;
+  int stock_batches; // how many batches of inputs a workshop takes in advance
+};
+
+const Recipe recipes[RECIPE_COUNT] = {
+    [RECIPE_GROW_MUSHROOMS] = {"grow mushrooms", {{SPORE, 1}}, {{MUSHROOM, 1}}, 600, 2},
+};
+
+struct StructureDef {
+  const char *name;
+  RecipeType recipe;
+};
+
+const StructureDef structure_defs[] = {
+    [NONE] = {"ground", NO_RECIPE},
+    [STAIRCASE] = {"staircase", NO_RECIPE},
+    [CORRIDOR] = {"corridor", NO_RECIPE},
+    [MUSHROOM_FARM] = {"mushroom_farm", RECIPE_GROW_MUSHROOMS},
+};
+
+Structure *Structure::New(StructureType type) {
+  if (type <= NONE || type >= int(sizeof(structure_defs) / sizeof(structure_defs[0]))) {
+    fprintf(stderr, "Unknown structure type: %d\n", type);
+    return nullptr;
+  }
+  Structure *s = new Structure();
+  s->type = type;
+  return s;
+}
+
+struct WorkshopLane {
+  vector<Structure *> structures;
+  vector<Cell> cells;
+  vector<array<uint16_t, RECIPE_SLOTS>> stock; // delivered inputs not used yet
+  vector<int64_t> started;                     // tick the running batch started, -1 if idle
+  vector<int32_t> finished;                    // scratch for AdvanceProduction()
 };
 
 struct Plan {
@@ -163,6 +215,8 @@ struct Plan {
   Dwarf *assignee;
 
   Plan(StructureType _structure_type) : structure_type(_structure_type), progress(0), assignee(nullptr) {}
+
+  Plan() : Plan(NONE) {}
 };
 
 }
@@ -170,82 +224,557 @@ namespace std {
 template<>
 struct hash<bb::Cell> {
   size_t operator()(const bb::Cell &cell) const {
-    return (hash<int>()(cell.col) >> 1) ^ hash<int>()(cell.row);
+    // Both coordinates in full - folding them together made large maps collide heavily.
+    return hash<uint64_t>()((uint64_t(uint32_t(cell.row)) << 32) | uint32_t(cell.col));
   }
 };
 }
 
 namespace bb {
 
-unordered_map<Cell, Structure *> cells;
-unordered_map<Cell, Plan *> plans;
-unordered_multimap<Cell, Item *> items;
+enum SearchEngine {
+  SEARCH_REFERENCE = 0, // the original search, kept to check SEARCH_FAST against
+  SEARCH_FAST
+};
+
+// What a dwarf was doing at the end of a tick.
+struct DwarfAssignment {
+  int id;
+  bool plan, structure;
+  Cell destination;
+  bool has_item; // assigned_item
+  Point item_pos;
+  Point waypoint; // the first step of the path
+  Point pos;
+};
+
+struct DwarfOrder {
+  bool operator()(const Dwarf *a, const Dwarf *b) const;
+};
+
+// Maps keyed by cell whose nodes are counted under `tag`.
+template<class V, MemoryTag tag>
+using CellMap = unordered_map<Cell, V, hash<Cell>, equal_to<Cell>, TrackedAllocator<pair<const Cell, V>, tag>>;
+template<class V, MemoryTag tag>
+using CellMultimap = unordered_multimap<Cell, V, hash<Cell>, equal_to<Cell>, TrackedAllocator<pair<const Cell, V>, tag>>;
+
+// Chunks of CHUNK_SIZE x CHUNK_SIZE cells are the unit of the region hashes, of the render
+// summaries and of paging.
+constexpr int CHUNK_SIZE = 16;
+
+Cell ChunkOf(const Cell &cell) {
+  return Cell(div_floor(cell.row, CHUNK_SIZE), div_floor(cell.col, CHUNK_SIZE));
+}
+
+// Top left cell of a chunk.
+Cell ChunkOrigin(const Cell &chunk) {
+  return Cell(chunk.row * CHUNK_SIZE, chunk.col * CHUNK_SIZE);
+}
+
+/**
+ * Chunk paging.
+ *
+ * When paging is enabled, chunks that no dwarf, job or camera view has used for
+ * `evict_after` ticks are written to a page file, and their structures, plans and items are
+ * deleted. A ChunkPage stays behind. It records where the chunk's record is, which cells can
+ * be walked through and how many jobs the chunk holds.
+ *
+ * The search walks through evicted chunks using these masks. It pages a chunk back in when
+ * it reaches one that has jobs. Edits and dwarves entering a chunk page it in as well.
+ * Evicted objects keep their share of the world hash, so paging never changes the outcome of
+ * a simulation - only how much of it is resident.
+ */
+static_assert(CHUNK_SIZE <= 16, "ChunkPage masks hold a row in 16 bits");
+
+struct ChunkPage {
+  uint64_t offset = 0; // record in the page file
+  uint32_t size = 0;
+  uint16_t travel[CHUNK_SIZE] = {}; // bit c of row r: the cell holds a structure
+  uint16_t stairs[CHUNK_SIZE] = {};
+  int32_t structures = 0, plans = 0, items = 0, workshops = 0;
+  uint64_t hash = 0; // sum of the keys of the evicted objects
+
+  // Anything the search could hand out - plans, items and workshops taking deliveries.
+  bool HasJobs() const { return plans > 0 || items > 0 || workshops > 0; }
+
+  static bool Bit(const uint16_t *mask, const Cell &cell) {
+    return mask[cell.row - div_floor(cell.row, CHUNK_SIZE) * CHUNK_SIZE] >>
+               (cell.col - div_floor(cell.col, CHUNK_SIZE) * CHUNK_SIZE) & 1;
+  }
+};
+
+// Records in the page file: a ChunkRecord followed by its structures, plans and items.
+struct ChunkRecord {
+  int32_t row, col; // in chunks
+  uint32_t structures, plans, items, reserved;
+};
+
+struct PagedStructure {
+  int32_t row, col;
+  uint32_t type;
+  uint16_t stock[RECIPE_SLOTS]; // workshop state, if the structure is one
+  int64_t started;
+};
+
+struct PagedPlan {
+  int32_t row, col;
+  uint32_t structure_type;
+  uint32_t reserved;
+  double progress;
+};
+
+struct PagedItem {
+  int32_t row, col; // the cell it is filed under - not always the one it lies in
+  int32_t y, x;
+  uint32_t type;
+  uint32_t reserved;
+};
+
+struct ChunkPager {
+  bool enabled = false;
+  int64_t evict_after = 1800; // idle ticks before a chunk is evicted
+  PageFile file;
+  CellMap<ChunkPage, MEMORY_CHUNK_PAGES> evicted;
+  CellMap<int64_t, MEMORY_CHUNK_PAGES> touched; // tick each resident chunk was last used
+  // Totals over `evicted`.
+  int64_t structures = 0, plans = 0, items = 0;
+  int64_t evictions = 0, page_ins = 0;
+  // FindPage()'s last answer - the search asks about the same few chunks over and over.
+  // Dropped whenever `evicted` changes.
+  mutable bool last_valid = false;
+  mutable Cell last_chunk;
+  mutable const ChunkPage *last_page = nullptr;
+};
+
+/**
+ * All simulation state. Worlds don't share anything, so a process can hold any number of
+ * them and tick each on its own thread.
+ */
+struct World {
+  CellMap<Structure *, MEMORY_CELL_MAP> cells;
+  CellMap<Plan *, MEMORY_PLAN_MAP> plans;
+  CellMultimap<Item *, MEMORY_ITEM_MAP> items;
+  set<Dwarf *, DwarfOrder> dwarves;
+  int money = 1000000;
+  int64_t tick_number = 0;
+  int next_dwarf_id = 0;
+  int64_t plans_completed = 0;
+  int64_t batches_completed = 0;
+  EventBus events;
+  TimerWheel timers;
+  // Every dwarf gets a stream split off this one.
+  random::Rng rng;
+
+  // Incremental state hash - see below.
+  uint64_t hash = 0;
+  unordered_map<Cell, uint64_t> region_hashes;
+
+  // Cells whose structure changed and cells whose plan made progress, kept only while
+  // `log_structure_changes` is set. The render pipeline (pipeline.h) uses them to update its
+  // copies of `cells` and `plans` incrementally.
+  bool log_structure_changes = false;
+  vector<Cell> structure_changes;
+  vector<Cell> plan_changes;
+
+  WorkshopLane workshops[RECIPE_COUNT];
+
+  ChunkPager pager;
+
+  // Plans come from a pool, so laying out large areas doesn't allocate per cell.
+  vector<unique_ptr<Plan[]>> plan_blocks;
+  vector<Plan *> free_plans;
+  // Bumped once per plan edit - a single toggle or a whole area. Anything derived from the
+  // set of plans can compare it instead of watching individual cells.
+  int64_t plans_version = 0;
+  // Bumped when an item appears, disappears, is picked up or put down, and when a dwarf is
+  // added or removed. Carried items move with their dwarf without a bump.
+  int64_t items_version = 0;
+  int64_t dwarves_version = 0;
+
+  // Rebuilt every tick for crowd separation. Kept here so its buffers are reused.
+  DwarfGrid dwarf_grid;
+  vector<Dwarf *> separation_dwarves;
+  vector<int> separation_steps;
+
+  SearchEngine search_engine = SEARCH_FAST;
+  // Filled by every Tick() while set - the results oracle.h compares.
+  bool record_assignments = false;
+  vector<DwarfAssignment> assignments;
+
+  // Search counters of the last tick and of all ticks so far.
+  SearchStats tick_stats;
+  SearchTotals search_totals;
+
+  World() = default;
+  World(const World &) = delete;
+  World &operator=(const World &) = delete;
+  ~World();
+};
+
+/**
+ * Incremental state hash.
+ *
+ * Every structure, plan, item and dwarf hashes to a 64-bit key and the world hash is the sum
+ * of all keys. Each mutation subtracts the old key and adds the new one, which is O(1). A sum
+ * is used instead of the classic Zobrist XOR so that identical objects (two spores lying on
+ * the same spot) don't cancel out.
+ *
+ * The keys are also summed per 16x16 region. A region hash can serve as the cache key of
+ * any computation that depends only on that region.
+ */
+uint64_t HashMix(uint64_t x) { // splitmix64 finalizer
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+uint64_t HashKey(uint64_t tag, int64_t a, int64_t b, uint64_t c) {
+  return HashMix(HashMix(HashMix(tag * 0x9e3779b97f4a7c15ULL + uint64_t(a)) + uint64_t(b)) + c);
+}
+
+void HashAdd(World &w, const Cell &region_cell, uint64_t key) {
+  w.hash += key;
+  w.region_hashes[ChunkOf(region_cell)] += key;
+}
 
-void AddItem(Point pos, ItemType item_type) {
+void HashRemove(World &w, const Cell &region_cell, uint64_t key) {
+  w.hash -= key;
+  auto it = w.region_hashes.find(ChunkOf(region_cell));
+  if (it != w.region_hashes.end() && (it->second -= key) == 0) w.region_hashes.erase(it);
+}
+
+uint64_t StructureKey(const Cell &cell, StructureType type) {
+  return HashKey(1, cell.row, cell.col, type);
+}
+
+uint64_t PlanKey(const Cell &cell, const Plan *plan) {
+  uint64_t progress;
+  memcpy(&progress, &plan->progress, sizeof(progress));
+  return HashKey(2, cell.row, cell.col, HashMix(plan->structure_type) ^ progress);
+}
+
+uint64_t ItemKey(const Item *item) {
+  return HashKey(3, item->pos.y, item->pos.x, item->def->type);
+}
+
+uint64_t DwarfKey(int id, const Point &pos, const Item *carried) {
+  return HashKey(4, id, (int64_t(pos.y) << 32) ^ uint32_t(pos.x), carried ? carried->def->type + 1 : 0);
+}
+
+uint64_t WorkshopKey(const WorkshopLane &lane, int32_t i) {
+  uint64_t stock = 0;
+  for (int k = 0; k < RECIPE_SLOTS; ++k) stock = stock << 16 | lane.stock[i][k];
+  return HashKey(5, lane.cells[i].row, lane.cells[i].col, HashMix(stock) ^ uint64_t(lane.started[i]));
+}
+
+uint64_t WorldHash(const World &w) {
+  return w.hash;
+}
+
+void LogStructureChange(World &w, const Cell &cell) {
+  if (w.log_structure_changes) w.structure_changes.push_back(cell);
+}
+
+// Pages in the chunk of `cell` if it is evicted - see "Chunk paging" below.
+void PageIn(World &w, const Cell &cell);
+
+// The page of the evicted chunk holding `cell`, nullptr if the chunk is resident.
+const ChunkPage *FindPage(const World &w, const Cell &cell) {
+  const ChunkPager &pager = w.pager;
+  if (pager.evicted.empty()) return nullptr;
+  Cell chunk = ChunkOf(cell);
+  if (pager.last_valid && pager.last_chunk == chunk) return pager.last_page;
+  auto it = pager.evicted.find(chunk);
+  pager.last_valid = true;
+  pager.last_chunk = chunk;
+  pager.last_page = it == pager.evicted.end() ? nullptr : &it->second;
+  return pager.last_page;
+}
+
+void AddItem(World &w, Point pos, ItemType item_type) {
+  PageIn(w, Cell(pos));
   Item *item = new Item();
   item->def = &item_defs[item_type];
   item->pos = pos;
-  items.insert(make_pair(Cell(item->pos), item));
+  item->cell = Cell(pos);
+  w.items.insert(make_pair(item->cell, item));
+  HashAdd(w, Cell(item->pos), ItemKey(item));
+  ++w.items_version;
+}
+
+// Removes an item lying anywhere in the world and deletes it.
+void RemoveItem(World &w, Item *item) {
+  HashRemove(w, Cell(item->pos), ItemKey(item));
+  auto range = w.items.equal_range(item->cell);
+  auto it = find_if(range.first, range.second, [item](const pair<const Cell, Item *> &p) { return p.second == item; });
+  if (it != range.second) w.items.erase(it);
+  delete item;
+  ++w.items_version;
+}
+
+RecipeType RecipeOf(StructureType type) {
+  return structure_defs[type].recipe;
+}
+
+// Registers the structure at `cell` as a workshop if its type has a recipe.
+void AddWorkshop(World &w, const Cell &cell, Structure *structure) {
+  RecipeType recipe = RecipeOf(structure->type);
+  if (recipe == NO_RECIPE) return;
+  WorkshopLane &lane = w.workshops[recipe];
+  structure->workshop = (int32_t) lane.structures.size();
+  lane.structures.push_back(structure);
+  lane.cells.push_back(cell);
+  lane.stock.push_back({});
+  lane.started.push_back(-1);
+  HashAdd(w, cell, WorkshopKey(lane, structure->workshop));
+}
+
+// Drops the workshop state of a structure - whatever it held is lost.
+void RemoveWorkshop(World &w, Structure *structure) {
+  if (structure->workshop < 0) return;
+  WorkshopLane &lane = w.workshops[RecipeOf(structure->type)];
+  int32_t i = structure->workshop, last = (int32_t) lane.structures.size() - 1;
+  HashRemove(w, lane.cells[i], WorkshopKey(lane, i));
+  lane.structures[i] = lane.structures[last];
+  lane.cells[i] = lane.cells[last];
+  lane.stock[i] = lane.stock[last];
+  lane.started[i] = lane.started[last];
+  lane.structures[i]->workshop = i;
+  lane.structures.pop_back();
+  lane.cells.pop_back();
+  lane.stock.pop_back();
+  lane.started.pop_back();
+  structure->workshop = -1;
+}
+
+// Input slot of the structure's recipe that takes `type` and has room, or -1.
+int WorkshopSlotFor(const World &w, const Structure *structure, ItemType type) {
+  if (structure->workshop < 0) return -1;
+  RecipeType recipe = RecipeOf(structure->type);
+  const Recipe &r = recipes[recipe];
+  for (int k = 0; k < RECIPE_SLOTS; ++k) {
+    if (r.inputs[k].count == 0 || r.inputs[k].type != type) continue;
+    if (w.workshops[recipe].stock[structure->workshop][k] < r.inputs[k].count * r.stock_batches) return k;
+  }
+  return -1;
+}
+
+void StockWorkshop(World &w, Structure *structure, int slot) {
+  WorkshopLane &lane = w.workshops[RecipeOf(structure->type)];
+  int32_t i = structure->workshop;
+  HashRemove(w, lane.cells[i], WorkshopKey(lane, i));
+  ++lane.stock[i][slot];
+  HashAdd(w, lane.cells[i], WorkshopKey(lane, i));
 }
 
-void AddStructure(int row, int col, Structure *structure) {
+/**
+ * Runs one tick of every workshop, one recipe at a time.
+ *
+ * A pass over a lane only compares numbers in its arrays - waiting and running workshops
+ * cost a few instructions each. Starting and finishing batches (which update the world
+ * hash and create items) happens for the few workshops that need it.
+ */
+void AdvanceProduction(World &w) {
+  for (int recipe = 0; recipe < RECIPE_COUNT; ++recipe) {
+    const Recipe &r = recipes[recipe];
+    WorkshopLane &lane = w.workshops[recipe];
+    const int32_t n = (int32_t) lane.structures.size();
+    const int64_t done = w.tick_number - r.ticks;
+    lane.finished.clear();
+    for (int32_t i = 0; i < n; ++i) {
+      int64_t started = lane.started[i];
+      if (started >= 0) {
+        if (started <= done) lane.finished.push_back(i);
+        continue;
+      }
+      bool ready = true;
+      for (int k = 0; k < RECIPE_SLOTS; ++k) ready &= lane.stock[i][k] >= r.inputs[k].count;
+      if (!ready) continue;
+      HashRemove(w, lane.cells[i], WorkshopKey(lane, i));
+      for (int k = 0; k < RECIPE_SLOTS; ++k) lane.stock[i][k] -= r.inputs[k].count;
+      lane.started[i] = w.tick_number;
+      HashAdd(w, lane.cells[i], WorkshopKey(lane, i));
+    }
+    for (int32_t i : lane.finished) {
+      const Cell &cell = lane.cells[i];
+      HashRemove(w, cell, WorkshopKey(lane, i));
+      lane.started[i] = -1;
+      HashAdd(w, cell, WorkshopKey(lane, i));
+      ++w.batches_completed;
+      for (int k = 0; k < RECIPE_SLOTS; ++k) {
+        const ItemDef &def = item_defs[r.outputs[k].type];
+        for (int j = 0; j < r.outputs[k].count; ++j)
+          AddItem(w, Point(cell.row * H + H / 2, cell.col * W + (W - def.w) / 2), def.type);
+      }
+    }
+  }
+}
+
+void AddStructure(World &w, int row, int col, Structure *structure) {
   Cell coord = {row, col};
-  auto it = cells.find(coord);
-  if (it == cells.end()) {
-    cells.insert(make_pair(coord, structure));
+  PageIn(w, coord);
+  auto it = w.cells.find(coord);
+  if (it == w.cells.end()) {
+    w.cells.insert(make_pair(coord, structure));
   } else {
+    HashRemove(w, coord, StructureKey(coord, it->second->type));
+    RemoveWorkshop(w, it->second);
     delete it->second;
-    cells[coord] = structure;
+    w.cells[coord] = structure;
   }
+  HashAdd(w, coord, StructureKey(coord, structure->type));
+  AddWorkshop(w, coord, structure);
+  LogStructureChange(w, coord);
 }
 
-bool IsStructureType(Cell cell, StructureType structure_type) {
-  auto it = cells.find(cell);
-  if (it == cells.end())
+bool IsStructureType(const World &w, Cell cell, StructureType structure_type) {
+  auto it = w.cells.find(cell);
+  if (it == w.cells.end())
     return false;
   else
     return it->second->type == structure_type;
 }
 
-bool CanTravelVertically(Cell cell) {
-  return (cell.row == 0) || IsStructureType(cell, STAIRCASE);
+bool CanTravelVertically(const World &w, Cell cell) {
+  if ((cell.row == 0) || IsStructureType(w, cell, STAIRCASE))
+    return true;
+  const ChunkPage *page = FindPage(w, cell);
+  return page && ChunkPage::Bit(page->stairs, cell);
 }
 
-bool CanTravel(Cell cell) {
+bool CanTravel(const World &w, Cell cell) {
   if (cell.row == 0)
     return true;
-  return cells.find(cell) != cells.end();
+  if (w.cells.find(cell) != w.cells.end())
+    return true;
+  const ChunkPage *page = FindPage(w, cell);
+  return page && ChunkPage::Bit(page->travel, cell);
+}
+
+bool HasPlan(const World &w, Cell cell) {
+  return w.plans.find(cell) != w.plans.end();
 }
 
-bool HasPlan(Cell cell) {
-  return plans.find(cell) != plans.end();
+const int PLAN_BLOCK = 256;
+
+Plan *NewPlan(World &w, StructureType structure_type) {
+  if (w.free_plans.empty()) {
+    w.plan_blocks.emplace_back(new Plan[PLAN_BLOCK]);
+    MemoryAlloc(MEMORY_PLANS, PLAN_BLOCK * sizeof(Plan));
+    for (int i = PLAN_BLOCK - 1; i >= 0; --i) w.free_plans.push_back(&w.plan_blocks.back()[i]);
+  }
+  Plan *plan = w.free_plans.back();
+  w.free_plans.pop_back();
+  *plan = Plan(structure_type);
+  return plan;
+}
+
+void DeletePlan(World &w, Plan *plan) {
+  w.free_plans.push_back(plan);
+}
+
+void TogglePlan(World &w, const Cell &c, StructureType structure_type) {
+  PageIn(w, c);
+  ++w.plans_version;
+  auto it = w.plans.find(c);
+  if (it != w.plans.end()) {
+    bool the_same = it->second->structure_type == structure_type;
+    HashRemove(w, c, PlanKey(c, it->second));
+    DeletePlan(w, it->second);
+    w.plans.erase(it);
+    if (the_same) return;
+  }
+  Plan *plan = NewPlan(w, structure_type);
+  w.plans[c] = plan;
+  HashAdd(w, c, PlanKey(c, plan));
 }
 
-Event<Dwarf> dwarf_created;
+const int64_t MAX_FILL_CELLS = 1 << 20;
+
+/**
+ * Plans `structure_type` on every cell of the rectangle spanned by `a` and `b` (a line if
+ * they share a row or column), or removes all plans there if it is NONE. Cells that already
+ * hold the structure are skipped and plans of the same type keep their progress. The whole
+ * area counts as one edit. Returns the number of cells that changed.
+ */
+int FillPlans(World &w, const Cell &a, const Cell &b, StructureType structure_type) {
+  int top = min(a.row, b.row), bottom = max(a.row, b.row);
+  int left = min(a.col, b.col), right = max(a.col, b.col);
+  int64_t area = int64_t(bottom - top + 1) * (right - left + 1);
+  if (area > MAX_FILL_CELLS) {
+    fprintf(stderr, "Plan area of %lld cells is too large\n", (long long) area);
+    return 0;
+  }
+  if (!w.pager.evicted.empty()) {
+    for (int row = div_floor(top, CHUNK_SIZE); row <= div_floor(bottom, CHUNK_SIZE); ++row)
+      for (int col = div_floor(left, CHUNK_SIZE); col <= div_floor(right, CHUNK_SIZE); ++col)
+        PageIn(w, Cell(row * CHUNK_SIZE, col * CHUNK_SIZE));
+  }
+  if (structure_type != NONE) w.plans.reserve(w.plans.size() + size_t(area));
+  int changed = 0;
+  for (int row = top; row <= bottom; ++row) {
+    for (int col = left; col <= right; ++col) {
+      Cell c(row, col);
+      auto it = w.plans.find(c);
+      bool had_plan = it != w.plans.end();
+      if (had_plan) {
+        if (it->second->structure_type == structure_type) continue;
+        HashRemove(w, c, PlanKey(c, it->second));
+        DeletePlan(w, it->second);
+        w.plans.erase(it);
+      }
+      bool wanted = structure_type != NONE && !IsStructureType(w, c, structure_type);
+      if (wanted) {
+        Plan *plan = NewPlan(w, structure_type);
+        w.plans.emplace(c, plan);
+        HashAdd(w, c, PlanKey(c, plan));
+      }
+      if (had_plan || wanted) ++changed;
+    }
+  }
+  if (changed) ++w.plans_version;
+  return changed;
+}
 
 struct Dwarf {
+  int id = 0; // creation order - keeps iteration over dwarves deterministic
+  random::Rng rng;
   string name;
   Point pos;
-  Event<string> said_something;
   Item *item = nullptr;
 
-  static Dwarf *MakeRandom(int row, int col) {
+  static Dwarf *MakeRandom(World &w, int row, int col) {
     Dwarf *d = new Dwarf();
-    d->name = namegen::gen();
+    d->id = w.next_dwarf_id++;
+    d->rng = w.rng.Split();
+    d->name = namegen::gen(d->rng);
     d->pos = Waypoint(Cell(row, col));
-    dwarf_created.run(d);
-    d->Say("Hello!");
+    w.events.Post(WorldEvent{EVENT_DWARF_CREATED, d->id, nullptr});
+    d->Say(w, "Hello!");
     return d;
   }
 
-  void Say(string text) {
-    said_something.run(&text);
+  uint64_t Key() const {
+    return DwarfKey(id, pos, item);
+  }
+
+  static const int SPEECH_TICKS = 300; // 5 s at 60 ticks per second
+
+  void Say(World &w, const char *text) {
+    w.events.Post(WorldEvent{EVENT_DWARF_SAID, id, text});
+    if (w.events.HasSubscribers(EVENT_DWARF_SPEECH_ENDED))
+      w.timers.Schedule(w.tick_number + SPEECH_TICKS, WorldEvent{EVENT_DWARF_SPEECH_ENDED, id, nullptr});
   }
 
   Plan *plan = nullptr;
   Structure *structure = nullptr;
   Item *assigned_item = nullptr;
   Cell destination = Cell(0, 0);
+  bool arrived = false; // the last GoToWork() didn't move - the dwarf is working in place
+  Point waypoint;        // where the last GoToWork() went
 
   void ReturnWork() {
     if (plan) {
@@ -262,7 +791,11 @@ struct Dwarf {
     }
   }
 
-  void GoToWork(const Point &waypoint) {
+  void GoToWork(World &w, const Point &waypoint) {
+    ScopedTimer timer(PROFILE_MOVEMENT);
+    this->waypoint = waypoint;
+    HashRemove(w, Cell(pos), Key());
+    if (item) HashRemove(w, Cell(item->pos), ItemKey(item));
     int dy = limit_abs<int>(waypoint.y - pos.y, 3);
     int dx = limit_abs<int>(waypoint.x - pos.x, 5);
     pos.y += dy;
@@ -270,9 +803,10 @@ struct Dwarf {
     if (item) {
       item->pos.x = pos.x;
       item->pos.y = pos.y;
+      HashAdd(w, Cell(item->pos), ItemKey(item));
     }
     if (Cell(waypoint) == destination) {
-      if (!CanTravel(destination)) {
+      if (!CanTravel(w, destination)) {
         AABB dwarf_bb = AABB(*this);
         AABB dest_bb = AABB(destination);
         if ((dx > 0) && (dwarf_bb.right >= dest_bb.left)) {
@@ -293,18 +827,38 @@ struct Dwarf {
           dy = 0;
         }
       }
-      if (plan && dx == 0 && dy == 0) {
-        plan->progress += 0.01;
-        if (plan->progress >= 1) {
-          cells[destination] = Structure::New(plan->structure_type);
-          plans.erase(destination);
-          delete plan;
-          plan = nullptr;
-        }
+    }
+    HashAdd(w, Cell(pos), Key());
+    arrived = dx == 0 && dy == 0;
+    if (Cell(waypoint) == destination && plan && dx == 0 && dy == 0) {
+      HashRemove(w, destination, PlanKey(destination, plan));
+      plan->progress += 0.01;
+      if (plan->progress >= 1) {
+        AddStructure(w, destination.row, destination.col, Structure::New(plan->structure_type));
+        ++w.plans_completed;
+        w.plans.erase(destination);
+        DeletePlan(w, plan);
+        ++w.plans_version;
+        plan = nullptr;
+      } else {
+        HashAdd(w, destination, PlanKey(destination, plan));
+        if (w.log_structure_changes) w.plan_changes.push_back(destination);
       }
     }
   }
 
+  // Sideways step that isn't part of a path - see SeparateDwarves().
+  void Nudge(World &w, int dx) {
+    HashRemove(w, Cell(pos), Key());
+    pos.x += dx;
+    if (item) {
+      HashRemove(w, Cell(item->pos), ItemKey(item));
+      item->pos.x = pos.x;
+      HashAdd(w, Cell(item->pos), ItemKey(item));
+    }
+    HashAdd(w, Cell(pos), Key());
+  }
+
   static const int width = 82;
   static const int height = 100;
 };
@@ -313,7 +867,447 @@ AABB::AABB(const Dwarf &dwarf)
     : left(dwarf.pos.x - Dwarf::width / 2), right(dwarf.pos.x + Dwarf::width / 2), top(dwarf.pos.y - Dwarf::height),
       bottom(dwarf.pos.y) {}
 
-set<Dwarf *> dwarves;
+bool DwarfOrder::operator()(const Dwarf *a, const Dwarf *b) const {
+  return a->id < b->id;
+}
+
+void AddDwarf(World &w, Dwarf *dwarf) {
+  w.dwarves.insert(dwarf);
+  ++w.dwarves_version;
+  HashAdd(w, Cell(dwarf->pos), dwarf->Key());
+}
+
+// Rebuilds the hashes from scratch - after bulk loads, or to verify the incremental updates.
+uint64_t RecomputeWorldHash(World &w) {
+  w.hash = 0;
+  w.region_hashes.clear();
+  for (auto &p : w.cells) HashAdd(w, p.first, StructureKey(p.first, p.second->type));
+  for (auto &p : w.plans) HashAdd(w, p.first, PlanKey(p.first, p.second));
+  for (auto &p : w.items) HashAdd(w, Cell(p.second->pos), ItemKey(p.second));
+  for (Dwarf *d : w.dwarves) HashAdd(w, Cell(d->pos), d->Key());
+  for (const WorkshopLane &lane : w.workshops)
+    for (int32_t i = 0; i < (int32_t) lane.structures.size(); ++i) HashAdd(w, lane.cells[i], WorkshopKey(lane, i));
+  for (auto &p : w.pager.evicted) HashAdd(w, ChunkOrigin(p.first), p.second.hash);
+  return w.hash;
+}
+
+// Deletes all objects. Event subscribers stay.
+void ClearWorld(World &w) {
+  for (auto &p : w.cells) {
+    LogStructureChange(w, p.first);
+    delete p.second;
+  }
+  w.cells.clear();
+  for (WorkshopLane &lane : w.workshops) {
+    lane.structures.clear();
+    lane.cells.clear();
+    lane.stock.clear();
+    lane.started.clear();
+  }
+  for (auto &p : w.plans) DeletePlan(w, p.second);
+  w.plans.clear();
+  ++w.plans_version;
+  for (auto &p : w.items) delete p.second;
+  w.items.clear();
+  ++w.items_version;
+  ChunkPager &pager = w.pager;
+  if (w.log_structure_changes) {
+    for (auto &p : pager.evicted) {
+      for (int r = 0; r < CHUNK_SIZE; ++r)
+        for (int c = 0; c < CHUNK_SIZE; ++c)
+          if (p.second.travel[r] >> c & 1) LogStructureChange(w, Cell(p.first.row * CHUNK_SIZE + r, p.first.col * CHUNK_SIZE + c));
+    }
+  }
+  pager.evicted.clear();
+  pager.last_valid = false;
+  pager.touched.clear();
+  pager.file.Reset();
+  pager.structures = pager.plans = pager.items = 0;
+  for (Dwarf *d : w.dwarves) delete d;
+  w.dwarves.clear();
+  ++w.dwarves_version;
+  w.hash = 0;
+  w.region_hashes.clear();
+  w.timers.Reset(w.tick_number);
+}
+
+World::~World() {
+  ClearWorld(*this);
+  MemoryFree(MEMORY_PLANS, int64_t(plan_blocks.size()) * PLAN_BLOCK * sizeof(Plan));
+}
+
+// The world shown by the game and operated on by the command line tools.
+World world;
+
+/**
+ * Chunk paging - see ChunkPage.
+ *
+ * EvictIdleChunks() runs every PAGE_SCAN_TICKS ticks. It groups the resident objects by
+ * chunk, and a chunk whose last use is at least `evict_after` ticks old is written out as one
+ * record and deleted. Chunks where something is still going on - an item another dwarf
+ * carries, a workshop with a running or ready batch - stay resident and count as used. The
+ * grouping is skipped while no chunk is due, except every PAGE_FULL_SCAN_TICKS ticks, which
+ * is how chunks nobody has used yet get noticed.
+ */
+const int PAGE_SCAN_TICKS = 60;
+const int PAGE_FULL_SCAN_TICKS = 600;
+const int MAX_VIEW_CHUNKS = 4096; // larger camera views are too far out to show plans and items
+
+bool EnablePaging(World &w, const string &path, int64_t evict_after) {
+  if (!w.pager.file.Open(path)) return false;
+  w.pager.enabled = true;
+  w.pager.evict_after = evict_after;
+  return true;
+}
+
+bool ReadChunkRecord(const World &w, const ChunkPage &page, vector<char> &data) {
+  data.resize(page.size);
+  if (!w.pager.file.Read(page.offset, data.data(), data.size())) {
+    fprintf(stderr, "Failed to read the page file\n");
+    return false;
+  }
+  return true;
+}
+
+template<class T>
+const T *ChunkRecordArray(const vector<char> &data, size_t offset) {
+  return reinterpret_cast<const T *>(data.data() + offset);
+}
+
+void PageIn(World &w, const Cell &cell) {
+  ChunkPager &pager = w.pager;
+  if (pager.evicted.empty()) return;
+  Cell chunk = ChunkOf(cell);
+  auto it = pager.evicted.find(chunk);
+  if (it == pager.evicted.end()) return;
+  const ChunkPage page = it->second;
+  pager.evicted.erase(it);
+  pager.last_valid = false;
+  pager.structures -= page.structures;
+  pager.plans -= page.plans;
+  pager.items -= page.items;
+  ++pager.page_ins;
+  pager.touched[chunk] = w.tick_number;
+  HashRemove(w, ChunkOrigin(chunk), page.hash);
+  vector<char> data;
+  bool ok = ReadChunkRecord(w, page, data);
+  pager.file.Free(page.offset, page.size);
+  if (!ok) {
+    fprintf(stderr, "Chunk %d-%d is lost\n", chunk.row, chunk.col);
+    return;
+  }
+
+  const ChunkRecord &record = *ChunkRecordArray<ChunkRecord>(data, 0);
+  const PagedStructure *structures = ChunkRecordArray<PagedStructure>(data, sizeof(ChunkRecord));
+  const PagedPlan *plans = reinterpret_cast<const PagedPlan *>(structures + record.structures);
+  const PagedItem *items = reinterpret_cast<const PagedItem *>(plans + record.plans);
+  for (uint32_t i = 0; i < record.structures; ++i) {
+    Cell c(structures[i].row, structures[i].col);
+    Structure *structure = Structure::New((StructureType) structures[i].type);
+    if (!structure) continue;
+    w.cells.emplace(c, structure);
+    HashAdd(w, c, StructureKey(c, structure->type));
+    AddWorkshop(w, c, structure);
+    if (structure->workshop >= 0) {
+      WorkshopLane &lane = w.workshops[RecipeOf(structure->type)];
+      HashRemove(w, c, WorkshopKey(lane, structure->workshop));
+      for (int k = 0; k < RECIPE_SLOTS; ++k) lane.stock[structure->workshop][k] = structures[i].stock[k];
+      lane.started[structure->workshop] = structures[i].started;
+      HashAdd(w, c, WorkshopKey(lane, structure->workshop));
+    }
+  }
+  for (uint32_t i = 0; i < record.plans; ++i) {
+    Cell c(plans[i].row, plans[i].col);
+    Plan *plan = NewPlan(w, (StructureType) plans[i].structure_type);
+    plan->progress = plans[i].progress;
+    w.plans.emplace(c, plan);
+    HashAdd(w, c, PlanKey(c, plan));
+  }
+  if (record.plans) ++w.plans_version;
+  // Items were written in map order. An item goes in front of those with the same cell, so
+  // inserting them backwards restores the order of stacks.
+  for (uint32_t i = record.items; i-- > 0;) {
+    Item *item = new Item();
+    item->def = &item_defs[items[i].type < NO_ITEM_TYPE ? items[i].type : 0];
+    item->pos = Point(items[i].y, items[i].x);
+    item->assignee = nullptr;
+    item->cell = Cell(items[i].row, items[i].col);
+    w.items.insert(make_pair(item->cell, item));
+    HashAdd(w, Cell(item->pos), ItemKey(item));
+  }
+  if (record.items) ++w.items_version;
+}
+
+// The search calls this before it looks at a cell - walking through an evicted chunk only
+// needs its page, taking a job there needs the chunk.
+void PageInJobs(World &w, const Cell &cell) {
+  const ChunkPage *page = FindPage(w, cell);
+  if (page && page->HasJobs()) PageIn(w, cell);
+}
+
+// Dwarves may have walked into evicted chunks during the last tick.
+void PageInDwarves(World &w) {
+  if (w.pager.evicted.empty()) return;
+  for (Dwarf *d : w.dwarves) PageIn(w, Cell(d->pos));
+}
+
+// Keeps the chunks from `first` to `last` (in chunks) resident - the camera view.
+void TouchArea(World &w, const Cell &first, const Cell &last) {
+  if (first.row > last.row || first.col > last.col) return;
+  if (int64_t(last.row - first.row + 1) * (last.col - first.col + 1) > MAX_VIEW_CHUNKS) return;
+  for (int row = first.row; row <= last.row; ++row) {
+    for (int col = first.col; col <= last.col; ++col) {
+      PageIn(w, ChunkOrigin(Cell(row, col)));
+      w.pager.touched[Cell(row, col)] = w.tick_number;
+    }
+  }
+}
+
+// A workshop that will start or finish a batch without any delivery.
+bool WorkshopBusy(const World &w, const Structure *structure) {
+  if (structure->workshop < 0) return false;
+  RecipeType recipe = RecipeOf(structure->type);
+  const WorkshopLane &lane = w.workshops[recipe];
+  if (lane.started[structure->workshop] >= 0) return true;
+  for (int k = 0; k < RECIPE_SLOTS; ++k)
+    if (lane.stock[structure->workshop][k] < recipes[recipe].inputs[k].count) return false;
+  return true;
+}
+
+struct ChunkContents {
+  vector<pair<Cell, Structure *>> structures;
+  vector<pair<Cell, Plan *>> plans;
+  vector<pair<Cell, Item *>> items; // in map order
+  bool pinned = false;
+};
+
+bool EvictChunk(World &w, const Cell &chunk, const ChunkContents &contents) {
+  ChunkPager &pager = w.pager;
+  ChunkPage page;
+  page.structures = (int32_t) contents.structures.size();
+  page.plans = (int32_t) contents.plans.size();
+  page.items = (int32_t) contents.items.size();
+  vector<char> data(sizeof(ChunkRecord) + page.structures * sizeof(PagedStructure) +
+                    page.plans * sizeof(PagedPlan) + page.items * sizeof(PagedItem));
+  ChunkRecord *record = reinterpret_cast<ChunkRecord *>(data.data());
+  record->row = chunk.row;
+  record->col = chunk.col;
+  record->structures = page.structures;
+  record->plans = page.plans;
+  record->items = page.items;
+  PagedStructure *structures = reinterpret_cast<PagedStructure *>(record + 1);
+  for (auto &p : contents.structures) {
+    const Cell &c = p.first;
+    PagedStructure &out = *structures++;
+    out.row = c.row;
+    out.col = c.col;
+    out.type = p.second->type;
+    out.started = -1;
+    int r = c.row - chunk.row * CHUNK_SIZE, col = c.col - chunk.col * CHUNK_SIZE;
+    page.travel[r] |= uint16_t(1 << col);
+    if (p.second->type == STAIRCASE) page.stairs[r] |= uint16_t(1 << col);
+    page.hash += StructureKey(c, p.second->type);
+    if (p.second->workshop >= 0) {
+      const WorkshopLane &lane = w.workshops[RecipeOf(p.second->type)];
+      for (int k = 0; k < RECIPE_SLOTS; ++k) out.stock[k] = lane.stock[p.second->workshop][k];
+      out.started = lane.started[p.second->workshop];
+      page.hash += WorkshopKey(lane, p.second->workshop);
+      ++page.workshops;
+    }
+  }
+  PagedPlan *plans = reinterpret_cast<PagedPlan *>(structures);
+  for (auto &p : contents.plans) {
+    PagedPlan &out = *plans++;
+    out.row = p.first.row;
+    out.col = p.first.col;
+    out.structure_type = p.second->structure_type;
+    out.progress = p.second->progress;
+    page.hash += PlanKey(p.first, p.second);
+  }
+  PagedItem *items = reinterpret_cast<PagedItem *>(plans);
+  for (auto &p : contents.items) {
+    const Item *item = p.second;
+    PagedItem &out = *items++;
+    out.row = p.first.row;
+    out.col = p.first.col;
+    out.y = item->pos.y;
+    out.x = item->pos.x;
+    out.type = item->def->type;
+    page.hash += ItemKey(item);
+  }
+  if (!pager.file.Write(data, page.offset)) {
+    fprintf(stderr, "Failed to write to the page file - paging disabled\n");
+    pager.enabled = false;
+    return false;
+  }
+  page.size = (uint32_t) data.size();
+
+  // The objects leave the hash and the page's sum takes their place.
+  for (auto &p : contents.structures) {
+    HashRemove(w, p.first, StructureKey(p.first, p.second->type));
+    RemoveWorkshop(w, p.second);
+    w.cells.erase(p.first);
+    delete p.second;
+  }
+  for (auto &p : contents.plans) {
+    HashRemove(w, p.first, PlanKey(p.first, p.second));
+    w.plans.erase(p.first);
+    DeletePlan(w, p.second);
+  }
+  if (!contents.plans.empty()) ++w.plans_version;
+  for (auto &p : contents.items) {
+    HashRemove(w, Cell(p.second->pos), ItemKey(p.second));
+    w.items.erase(p.first); // no-op after the first item of a stack
+    delete p.second;
+  }
+  if (!contents.items.empty()) ++w.items_version;
+  HashAdd(w, ChunkOrigin(chunk), page.hash);
+  pager.structures += page.structures;
+  pager.plans += page.plans;
+  pager.items += page.items;
+  ++pager.evictions;
+  pager.touched.erase(chunk);
+  pager.evicted.emplace(chunk, page);
+  pager.last_valid = false;
+  return true;
+}
+
+void EvictIdleChunks(World &w) {
+  ChunkPager &pager = w.pager;
+  if (!pager.enabled || w.tick_number % PAGE_SCAN_TICKS != 0) return;
+  for (Dwarf *d : w.dwarves) {
+    Cell chunk = ChunkOf(Cell(d->pos));
+    for (int row = chunk.row - 1; row <= chunk.row + 1; ++row)
+      for (int col = chunk.col - 1; col <= chunk.col + 1; ++col)
+        if (!pager.evicted.count(Cell(row, col))) pager.touched[Cell(row, col)] = w.tick_number;
+  }
+
+  const int64_t idle_since = w.tick_number - pager.evict_after;
+  // Grouping the objects is the expensive part - skip it while no known chunk is due.
+  bool due = w.tick_number % PAGE_FULL_SCAN_TICKS == 0;
+  for (auto it = pager.touched.begin(); !due && it != pager.touched.end(); ++it) due = it->second <= idle_since;
+  if (!due) return;
+  unordered_map<Cell, ChunkContents> idle;
+  // Chunks seen for the first time count as used now.
+  auto idle_contents = [&](const Cell &cell) -> ChunkContents * {
+    Cell chunk = ChunkOf(cell);
+    auto it = pager.touched.find(chunk);
+    if (it == pager.touched.end()) it = pager.touched.emplace(chunk, w.tick_number).first;
+    return it->second <= idle_since ? &idle[chunk] : nullptr;
+  };
+  for (auto &p : w.cells) {
+    if (ChunkContents *c = idle_contents(p.first)) {
+      c->structures.push_back(p);
+      c->pinned |= WorkshopBusy(w, p.second);
+    }
+  }
+  for (auto &p : w.plans)
+    if (ChunkContents *c = idle_contents(p.first)) c->plans.push_back(p);
+  unordered_set<const Item *> carried;
+  for (Dwarf *d : w.dwarves)
+    if (d->item) carried.insert(d->item);
+  for (auto &p : w.items) {
+    if (ChunkContents *c = idle_contents(p.first)) {
+      c->items.push_back(p);
+      c->pinned |= carried.count(p.second) > 0;
+    }
+  }
+  int64_t evictions = pager.evictions;
+  for (auto &p : idle) {
+    if (p.second.pinned)
+      pager.touched[p.first] = w.tick_number;
+    else if (!EvictChunk(w, p.first, p.second))
+      break;
+  }
+  // Erasing doesn't shrink the bucket arrays.
+  if (pager.evictions != evictions) {
+    if (w.cells.size() * 4 < w.cells.bucket_count()) w.cells.rehash(0);
+    if (w.plans.size() * 4 < w.plans.bucket_count()) w.plans.rehash(0);
+    if (w.items.size() * 4 < w.items.bucket_count()) w.items.rehash(0);
+  }
+  // Idle chunks with nothing in them needn't be remembered.
+  for (auto it = pager.touched.begin(); it != pager.touched.end();) {
+    if (it->second <= idle_since && !idle.count(it->first))
+      it = pager.touched.erase(it);
+    else
+      ++it;
+  }
+}
+
+// Dwarves standing in a workshop with the item it was waiting for hand it over and are free
+// for the next job.
+void DeliverItems(World &w) {
+  for (Dwarf *d : w.dwarves) {
+    if (!d->structure || !d->arrived || !d->item || d->item != d->assigned_item || Cell(d->pos) != d->destination)
+      continue;
+    int slot = WorkshopSlotFor(w, d->structure, d->item->def->type);
+    if (slot < 0) continue;
+    HashRemove(w, Cell(d->pos), d->Key());
+    RemoveItem(w, d->item);
+    d->item = nullptr;
+    d->assigned_item = nullptr;
+    HashAdd(w, Cell(d->pos), d->Key());
+    StockWorkshop(w, d->structure, slot);
+    d->ReturnWork();
+  }
+}
+
+const int SEPARATION_RADIUS = Dwarf::width / 2; // dwarves closer than this push each other
+const int SEPARATION_STEP = 10;                 // max px per tick - more than a walk step
+const int SEPARATION_NEIGHBOURS = 8;            // keeps dense piles linear too
+
+/**
+ * Pushes overlapping dwarves apart horizontally.
+ *
+ * Dwarves find their neighbours through World::dwarf_grid, so this is linear in the number of
+ * dwarves. Pushes are computed from the positions at the start of the step and applied
+ * together, which keeps the result independent of iteration order. Dwarves working in place
+ * aren't pushed (so their work isn't interrupted) but still push others. A push never
+ * moves a dwarf into a cell it couldn't walk into.
+ */
+void SeparateDwarves(World &w) {
+  ScopedTimer timer(PROFILE_MOVEMENT);
+  DwarfGrid &grid = w.dwarf_grid;
+  vector<Dwarf *> &dwarves = w.separation_dwarves;
+  dwarves.assign(w.dwarves.begin(), w.dwarves.end());
+  grid.points.resize(dwarves.size());
+  for (size_t i = 0; i < dwarves.size(); ++i) grid.points[i] = GridPoint{dwarves[i]->pos.y, dwarves[i]->pos.x};
+  grid.Build(SEPARATION_RADIUS, Dwarf::height);
+
+  vector<int> &steps = w.separation_steps;
+  steps.assign(dwarves.size(), 0);
+  for (size_t i = 0; i < dwarves.size(); ++i) {
+    Dwarf *d = dwarves[i];
+    if (d->arrived && (d->plan || d->structure)) continue;
+    const GridPoint &p = grid.points[i];
+    int push = 0, neighbours = 0;
+    grid.ForEachNear(p, [&](int j) {
+      if (j == int(i)) return true;
+      const GridPoint &q = grid.points[j];
+      int dx = p.x - q.x;
+      if (abs(dx) >= SEPARATION_RADIUS || abs(p.y - q.y) >= Dwarf::height) return true;
+      // Dwarves on the same spot split by id.
+      int direction = dx > 0 ? 1 : dx < 0 ? -1 : d->id < dwarves[j]->id ? -1 : 1;
+      push += direction * (SEPARATION_RADIUS - abs(dx));
+      return ++neighbours < SEPARATION_NEIGHBOURS;
+    });
+    steps[i] = limit_abs(push / 2, SEPARATION_STEP);
+  }
+
+  for (size_t i = 0; i < dwarves.size(); ++i) {
+    if (steps[i] == 0) continue;
+    Dwarf *d = dwarves[i];
+    Cell from(d->pos);
+    Cell to(Point(d->pos.y, d->pos.x + steps[i]));
+    int step = steps[i];
+    // Only dwarves standing on the floor step into the next cell - not those halfway up a staircase.
+    if (to != from && (to.col < 0 || !CanTravel(w, to) || d->pos.y != Waypoint(from).y)) {
+      AABB bb(from);
+      step = clamp(d->pos.x + step, bb.left, bb.right) - d->pos.x;
+    }
+    if (step != 0) d->Nudge(w, step);
+  }
+}
 
 // TODO: preferential weighing of distances
 
@@ -336,6 +1330,8 @@ struct CellItem {
     return (cell != other.cell) || (item != other.item);
   }
 
+  bool operator==(const CellItem& other) const { return !(*this != other); }
+
   string ToString() {
     char arr[100];
     snprintf(arr, 100, "%s(%s)", cell.ToString().c_str(), item ? item->def->texture_name.c_str() : "null");
@@ -343,6 +1339,12 @@ struct CellItem {
   }
 };
 
+struct CellItemHash {
+  size_t operator()(const CellItem &c) const {
+    return hash<Cell>()(c.cell) ^ hash<const Item *>()(c.item) * 0x9E3779B97F4A7C15ull;
+  }
+};
+
 
     // TODO
 struct SearchStep {
@@ -359,41 +1361,62 @@ struct SearchAssign : SearchStep {
   
 };
   
-bool TakeWorkAt(Dwarf *dwarf, CellItem cell_item) {
+bool TakeWorkAt(World &w, Dwarf *dwarf, CellItem cell_item) {
   const Cell& cell = cell_item.cell;
   Item* item = cell_item.item;
-  auto plan_it = plans.find(cell);
-  if (plan_it != plans.end() && plan_it->second->assignee == nullptr) {
+  ++w.tick_stats.take_work_attempts;
+  auto plan_it = w.plans.find(cell);
+  if (plan_it != w.plans.end() && plan_it->second->assignee == nullptr) {
     dwarf->destination = cell;
     dwarf->plan = plan_it->second;
     dwarf->plan->assignee = dwarf;
+    ++w.tick_stats.take_work_successes;
     return true;
   }
-  auto struct_it = cells.find(cell);
-  if (struct_it != cells.end() && struct_it->second->type == MUSHROOM_FARM &&
-      struct_it->second->assignee == nullptr && item != nullptr && item->def->type == SPORE &&
-      item->assignee == nullptr) {
+  auto struct_it = w.cells.find(cell);
+  if (struct_it != w.cells.end() && struct_it->second->assignee == nullptr && item != nullptr &&
+      item->assignee == nullptr && WorkshopSlotFor(w, struct_it->second, item->def->type) >= 0) {
     dwarf->destination = cell;
     dwarf->structure = struct_it->second;
     dwarf->structure->assignee = dwarf;
     item->assignee = dwarf;
     dwarf->assigned_item = item;
+    ++w.tick_stats.take_work_successes;
     return true;
   }
   return false;
 }
 
-void Tick() {
-  map<Dwarf*, map<CellItem, CellItem>> shortest_path_tree;
-  multimap<double, pair<Dwarf*, pair<CellItem, CellItem>>> Q;
+// The search's containers live for one tick - they're counted under MEMORY_SEARCH.
+template<class T>
+using SearchAllocator = TrackedAllocator<T, MEMORY_SEARCH>;
+template<class K, class V>
+using SearchMap = map<K, V, less<K>, SearchAllocator<pair<const K, V>>>;
+
+// Per-dwarf search spans, only collected while a trace is being recorded.
+struct SearchSpan {
+  int64_t start = -1, end = 0;
+};
+
+// The original job search, kept as the reference SearchFast() is checked against (see
+// oracle.h). Change it only together with SearchFast(). The one change since: a cell already
+// in the search tree keeps its parent when a job is taken there, where the original
+// overwrote it and could loop forever while backtracking.
+void SearchReference(World &w) {
+  SearchMap<Dwarf*, SearchMap<CellItem, CellItem>> shortest_path_tree;
+  typedef pair<Dwarf*, pair<CellItem, CellItem>> QueueEntry;
+  multimap<double, QueueEntry, less<double>, SearchAllocator<pair<const double, QueueEntry>>> Q;
   auto Q_add = [&Q](double dist, Dwarf* dwarf, CellItem next, CellItem prev) {
     Q.insert( make_pair(dist, make_pair(dwarf, make_pair(next, prev))) );
   };
-  for (Dwarf *d : dwarves) {
+  const bool tracing = trace_enabled;
+  map<Dwarf*, SearchSpan> search_spans;
+  for (Dwarf *d : w.dwarves) {
     auto pos = d->pos;
     CellItem cell_item = CellItem(pos, d->item);
-    if (TakeWorkAt(d, cell_item)) { // skip search if already "standing" on a job
-      d->GoToWork(Waypoint(pos));
+    if (TakeWorkAt(w, d, cell_item)) { // skip search if already "standing" on a job
+      w.tick_stats.ForDwarf(d->id).path_length = 0;
+      d->GoToWork(w, Waypoint(pos));
     } else {
       Q_add(0, d, cell_item, cell_item);
     }
@@ -407,6 +1430,7 @@ void Tick() {
     CellItem current = current_source.first;
     CellItem source = current_source.second;
     //printf("Search step %d: '%s' is visiting %s from %s\n", search_counter, dwarf->name.c_str(), current.ToString().c_str(), source.ToString().c_str());
+    w.tick_stats.frontier_peak = max<int64_t>(w.tick_stats.frontier_peak, Q.size());
     Q.erase(p);
     if (dwarf->plan || dwarf->structure) continue;
     //printf("checkpoint A\n");
@@ -414,21 +1438,31 @@ void Tick() {
     if (visited.find(current) != visited.end()) continue;
     //printf("checkpoint B\n");
     visited[current] = source;
+    DwarfSearchStats &dwarf_stats = w.tick_stats.ForDwarf(dwarf->id);
+    ++dwarf_stats.nodes_expanded;
+    dwarf_stats.queue_peak = max<int64_t>(dwarf_stats.queue_peak, Q.size() + 1);
+    if (tracing) {
+      SearchSpan &span = search_spans[dwarf];
+      span.end = TraceNow();
+      if (span.start < 0) span.start = span.end;
+    }
     auto Peek = [&](CellItem next) -> bool {
       //printf(" - considering next step to %s\n", next.ToString().c_str());
       double next_dist = dist;
       if (next.cell.row == current.cell.row - 1) {
-        if (!CanTravelVertically(current.cell)) return false;
+        if (!CanTravelVertically(w, current.cell)) return false;
         next_dist += 2;
       }
       bool is_below = next.cell.row == current.cell.row + 1;
-      auto plan_it = plans.find(next.cell);
-      bool is_staircase_planned = plan_it != plans.end() &&
+      PageInJobs(w, next.cell);
+      auto plan_it = w.plans.find(next.cell);
+      bool is_staircase_planned = plan_it != w.plans.end() &&
                                   plan_it->second->structure_type == STAIRCASE;
-      if ((!is_below || is_staircase_planned) && TakeWorkAt(dwarf, next)) {
-        // add the next cell to the bfs tree regardless of reachability
-        visited[next] = current;
-        source = current;
+      if ((!is_below || is_staircase_planned) && TakeWorkAt(w, dwarf, next)) {
+        // add the next cell to the bfs tree regardless of reachability - unless it is in
+        // already (reached from above, where only staircases are taken), as a new parent
+        // could close a loop for the backtracking below
+        source = visited.emplace(next, current).first->second;
         current = next;
         // backtrack through bfs tree
         CellItem start = CellItem(Cell(dwarf->pos), dwarf->item);
@@ -441,10 +1475,12 @@ void Tick() {
         }
         printf("%s is assigned to %s\n", dwarf->name.c_str(), next.ToString().c_str());
          */
+        dwarf_stats.path_length = 1;
         while (source != start) {
           auto p = visited.find(source);
           current = p->first;
           source = p->second;
+          ++dwarf_stats.path_length;
         }
         Point first = Waypoint(source.cell); // cell where the dwarf is standing currently
         Point second = Waypoint(current.cell); // next cell in the path
@@ -453,27 +1489,33 @@ void Tick() {
         int my_dist = dwarf->pos.MetroDist(second);
         if (my_dist <= block_dist) {
           if (source.item != current.item) {
+            HashRemove(w, Cell(dwarf->pos), dwarf->Key());
             dwarf->item = current.item;
+            HashAdd(w, Cell(dwarf->pos), dwarf->Key());
+            ++w.items_version;
           }
-          dwarf->GoToWork(second);
+          dwarf->GoToWork(w, second);
         }
-        else dwarf->GoToWork(first);
+        else dwarf->GoToWork(w, first);
         return true;
       }
       if (next.cell.row == current.cell.row) {
-        if (!CanTravel(next.cell)) return false;
+        if (!CanTravel(w, next.cell)) return false;
         next_dist += 1;
       }
       if (next.cell.row == current.cell.row + 1) {
-        if (!CanTravelVertically(next.cell)) return false;
+        if (!CanTravelVertically(w, next.cell)) return false;
         next_dist += 2;
       }
       //printf(" - scheduling next step to %s\n", next.ToString().c_str());
       Q_add(next_dist, dwarf, next, current);
       return false;
     };
-    if (++search_counter > 1000) break;
-    auto range = items.equal_range(current.cell);
+    if (++search_counter > 1000) {
+      ++w.tick_stats.step_cap_hits;
+      break;
+    }
+    auto range = w.items.equal_range(current.cell);
     bool found = false;
     for (auto it = range.first; it != range.second; ++it) {
       if (Peek(CellItem(current.cell, it->second))) {
@@ -488,7 +1530,208 @@ void Tick() {
     if ((current.cell.row > 0) && Peek(CellItem(Cell(current.cell.row - 1, current.cell.col), current.item))) continue;
   }
 
-  for (Dwarf *d : dwarves) d->ReturnWork();
+  for (auto &p : search_spans) {
+    const SearchSpan &span = p.second;
+    const DwarfSearchStats &dwarf_stats = w.tick_stats.ForDwarf(p.first->id);
+    TraceComplete("dwarf search", span.start, span.end - span.start, p.first->name.c_str(),
+                  "nodes", dwarf_stats.nodes_expanded, "queue_peak", dwarf_stats.queue_peak);
+  }
+}
+
+// Same search as SearchReference() with cheaper containers: a binary heap for the queue and
+// hash maps for the search trees. Entries of equal distance still leave the queue in the
+// order they were added, so both engines hand out the same jobs and paths.
+void SearchFast(World &w) {
+  struct Entry {
+    double dist;
+    int64_t order;
+    int dwarf; // index into `dwarves`
+    CellItem next, prev;
+
+    bool operator<(const Entry &other) const { // reversed - priority_queue pops the largest
+      return dist != other.dist ? dist > other.dist : order > other.order;
+    }
+  };
+  typedef unordered_map<CellItem, CellItem, CellItemHash, equal_to<CellItem>,
+                        SearchAllocator<pair<const CellItem, CellItem>>> Tree;
+  vector<Dwarf *, SearchAllocator<Dwarf *>> dwarves(w.dwarves.begin(), w.dwarves.end());
+  vector<Tree, SearchAllocator<Tree>> shortest_path_tree(dwarves.size());
+  vector<DwarfSearchStats *, SearchAllocator<DwarfSearchStats *>> stats(dwarves.size());
+  priority_queue<Entry, vector<Entry, SearchAllocator<Entry>>> Q;
+  int64_t added = 0;
+  auto Q_add = [&](double dist, int dwarf, CellItem next, CellItem prev) {
+    Q.push(Entry{dist, added++, dwarf, next, prev});
+  };
+  const bool tracing = trace_enabled;
+  map<Dwarf*, SearchSpan> search_spans;
+  for (size_t i = 0; i < dwarves.size(); ++i) {
+    Dwarf *d = dwarves[i];
+    stats[i] = &w.tick_stats.dwarves[i];
+    CellItem cell_item = CellItem(d->pos, d->item);
+    if (TakeWorkAt(w, d, cell_item)) {
+      stats[i]->path_length = 0;
+      d->GoToWork(w, Waypoint(d->pos));
+    } else {
+      Q_add(0, int(i), cell_item, cell_item);
+    }
+  }
+  int search_counter = 0;
+  while (!Q.empty()) {
+    w.tick_stats.frontier_peak = max<int64_t>(w.tick_stats.frontier_peak, Q.size());
+    const Entry top = Q.top();
+    Q.pop();
+    const double dist = top.dist;
+    Dwarf *dwarf = dwarves[top.dwarf];
+    CellItem current = top.next;
+    CellItem source = top.prev;
+    if (dwarf->plan || dwarf->structure) continue;
+    auto &visited = shortest_path_tree[top.dwarf];
+    if (!visited.emplace(current, source).second) continue;
+    DwarfSearchStats &dwarf_stats = *stats[top.dwarf];
+    ++dwarf_stats.nodes_expanded;
+    dwarf_stats.queue_peak = max<int64_t>(dwarf_stats.queue_peak, Q.size() + 1);
+    if (tracing) {
+      SearchSpan &span = search_spans[dwarf];
+      span.end = TraceNow();
+      if (span.start < 0) span.start = span.end;
+    }
+    auto Peek = [&](CellItem next) -> bool {
+      double next_dist = dist;
+      if (next.cell.row == current.cell.row - 1) {
+        if (!CanTravelVertically(w, current.cell)) return false;
+        next_dist += 2;
+      }
+      bool is_below = next.cell.row == current.cell.row + 1;
+      PageInJobs(w, next.cell);
+      auto plan_it = w.plans.find(next.cell);
+      bool is_staircase_planned = plan_it != w.plans.end() &&
+                                  plan_it->second->structure_type == STAIRCASE;
+      if ((!is_below || is_staircase_planned) && TakeWorkAt(w, dwarf, next)) {
+        source = visited.emplace(next, current).first->second;
+        current = next;
+        CellItem start = CellItem(Cell(dwarf->pos), dwarf->item);
+        dwarf_stats.path_length = 1;
+        while (source != start) {
+          auto p = visited.find(source);
+          current = p->first;
+          source = p->second;
+          ++dwarf_stats.path_length;
+        }
+        Point first = Waypoint(source.cell);
+        Point second = Waypoint(current.cell);
+        int block_dist = first.MetroDist(second);
+        int my_dist = dwarf->pos.MetroDist(second);
+        if (my_dist <= block_dist) {
+          if (source.item != current.item) {
+            HashRemove(w, Cell(dwarf->pos), dwarf->Key());
+            dwarf->item = current.item;
+            HashAdd(w, Cell(dwarf->pos), dwarf->Key());
+            ++w.items_version;
+          }
+          dwarf->GoToWork(w, second);
+        }
+        else dwarf->GoToWork(w, first);
+        return true;
+      }
+      if (next.cell.row == current.cell.row) {
+        if (!CanTravel(w, next.cell)) return false;
+        next_dist += 1;
+      }
+      if (next.cell.row == current.cell.row + 1) {
+        if (!CanTravelVertically(w, next.cell)) return false;
+        next_dist += 2;
+      }
+      Q_add(next_dist, top.dwarf, next, current);
+      return false;
+    };
+    if (++search_counter > 1000) {
+      ++w.tick_stats.step_cap_hits;
+      break;
+    }
+    auto range = w.items.equal_range(current.cell);
+    bool found = false;
+    for (auto it = range.first; it != range.second; ++it) {
+      if (Peek(CellItem(current.cell, it->second))) {
+        found = true;
+        break;
+      }
+    }
+    if (found) continue;
+    if (Peek(CellItem(Cell(current.cell.row, current.cell.col + 1), current.item))) continue;
+    if ((current.cell.col > 0) && Peek(CellItem(Cell(current.cell.row, current.cell.col - 1), current.item))) continue;
+    if (Peek(CellItem(Cell(current.cell.row + 1, current.cell.col), current.item))) continue;
+    if ((current.cell.row > 0) && Peek(CellItem(Cell(current.cell.row - 1, current.cell.col), current.item))) continue;
+  }
+
+  for (auto &p : search_spans) {
+    const SearchSpan &span = p.second;
+    const DwarfSearchStats &dwarf_stats = w.tick_stats.ForDwarf(p.first->id);
+    TraceComplete("dwarf search", span.start, span.end - span.start, p.first->name.c_str(),
+                  "nodes", dwarf_stats.nodes_expanded, "queue_peak", dwarf_stats.queue_peak);
+  }
+}
+void Tick(World &w) {
+  ScopedTimer timer(PROFILE_SEARCH);
+  w.tick_stats.Clear(w.tick_number);
+  for (Dwarf *d : w.dwarves) {
+    w.tick_stats.dwarves.emplace_back();
+    w.tick_stats.dwarves.back().dwarf = d->id;
+  }
+  PageInDwarves(w);
+  if (w.search_engine == SEARCH_REFERENCE)
+    SearchReference(w);
+  else
+    SearchFast(w);
+
+  size_t i = 0;
+  for (Dwarf *d : w.dwarves) {
+    DwarfSearchStats &dwarf_stats = w.tick_stats.dwarves[i++];
+    dwarf_stats.found_job = d->plan || d->structure;
+    if (dwarf_stats.found_job) {
+      ++w.tick_stats.jobs_found;
+      if (d->structure && d->structure->type == MUSHROOM_FARM) ++w.tick_stats.farm_jobs;
+    } else {
+      ++w.tick_stats.jobs_failed;
+      dwarf_stats.path_length = -1;
+    }
+  }
+  DeliverItems(w);
+  AdvanceProduction(w);
+  SeparateDwarves(w);
+  if (w.record_assignments) {
+    w.assignments.clear();
+    for (Dwarf *d : w.dwarves) {
+      DwarfAssignment a;
+      a.id = d->id;
+      a.plan = d->plan != nullptr;
+      a.structure = d->structure != nullptr;
+      a.destination = d->destination;
+      a.has_item = d->assigned_item != nullptr;
+      a.item_pos = a.has_item ? d->assigned_item->pos : Point();
+      a.waypoint = d->waypoint;
+      a.pos = d->pos;
+      w.assignments.push_back(a);
+    }
+  }
+  w.search_totals.Add(w.tick_stats);
+  ++w.tick_number;
+  w.timers.Advance(w.tick_number, w.events);
+
+  for (Dwarf *d : w.dwarves) d->ReturnWork();
+  EvictIdleChunks(w);
+  w.events.Dispatch(w);
+}
+
+// Whether the world has settled after the last tick: no dwarf found work, none carries an
+// item, and no workshop has a batch running or ready to start.
+bool WorldIdle(const World &w) {
+  if (w.tick_stats.jobs_found) return false;
+  for (const Dwarf *d : w.dwarves)
+    if (d->item) return false;
+  for (const WorkshopLane &lane : w.workshops)
+    for (const Structure *structure : lane.structures)
+      if (WorkshopBusy(w, structure)) return false;
+  return true;
 }
 }
 
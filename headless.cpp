@@ -0,0 +1,222 @@
+// Headless simulation runner. Doesn't include, link or initialize SDL, so it can run on
+// build machines in bulk.
+//
+//   BunkerBuilderHeadless [--scenario <file> | --load <snapshot> | --generate <spec>]
+//                         [--ticks <n>] [--until-idle] [--seed <n>] [--summary <file.json>]
+//                         [--stats <file.csv>] [--trace <file.json>] [--record <log>]
+//                         [--save <snapshot>] [--check-hash] [--search reference|fast]
+//                         [--check-search] [--page-file <path>] [--evict-after <ticks>]
+//   BunkerBuilderHeadless --replay <log>
+//
+// Without a starting world the demo scene is used. The run ends after the tick limit
+// (scenario's `ticks`, otherwise 1000) or, with --until-idle, at the first tick after which no
+// dwarf found work or carries an item and no workshop batch is running or ready to start (see
+// WorldIdle() in game.h). A JSON summary goes to stdout or the --summary file, including what
+// each subsystem holds in memory at the end, its peak and how many bytes it allocated per tick.
+//
+// --check-search runs every tick with both search engines first (see oracle.h) and stops at
+// the first tick in which they disagree, saving the world before it to search_divergence.bbs.
+//
+// --replay runs a recording (see replay.h) instead and exits with 0 if it ends in the recorded
+// state, 2 if it doesn't (or can't be read).
+//
+// --page-file evicts chunks nobody has used for --evict-after ticks (1800 by default) to the
+// given file, which is deleted right away and lives only as long as the run (see game.h).
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "game.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "worldgen.h"
+#include "scenario.h"
+#include "trace.h"
+#include "oracle.h"
+
+using namespace std;
+using namespace bb;
+
+// Bytes held now, the peak, and bytes allocated per tick since `start`.
+void WriteMemoryStats(FILE *f, const char *name, const MemoryStats &s, const MemoryStats &start, int64_t ticks,
+                      bool last) {
+  fprintf(f, "    \"%s\": {\"current\": %lld, \"peak\": %lld, \"allocated_per_tick\": %.1f}%s\n", name,
+          (long long) s.current, (long long) s.peak, ticks ? double(s.allocated - start.allocated) / ticks : 0.,
+          last ? "" : ",");
+}
+
+void WriteSummary(FILE *f, const World &w, int64_t ticks, double seconds, const char *stop_reason,
+                  const MemoryStats *memory_start) {
+  const SearchTotals &t = w.search_totals;
+  fprintf(f, "{\n");
+  fprintf(f, "  \"ticks\": %lld,\n", (long long) ticks);
+  fprintf(f, "  \"seconds\": %.6f,\n", seconds);
+  fprintf(f, "  \"ticks_per_second\": %.1f,\n", seconds > 0 ? ticks / seconds : 0.);
+  fprintf(f, "  \"stop_reason\": \"%s\",\n", stop_reason);
+  fprintf(f, "  \"dwarves\": %d,\n", (int) w.dwarves.size());
+  fprintf(f, "  \"structures\": %lld,\n", (long long) (w.cells.size() + w.pager.structures));
+  fprintf(f, "  \"plans_open\": %lld,\n", (long long) (w.plans.size() + w.pager.plans));
+  fprintf(f, "  \"plans_completed\": %lld,\n", (long long) w.plans_completed);
+  fprintf(f, "  \"farm_dwarf_ticks\": %lld,\n", (long long) t.farm_jobs);
+  fprintf(f, "  \"batches_completed\": %lld,\n", (long long) w.batches_completed);
+  fprintf(f, "  \"idle_dwarf_ratio\": %.4f,\n", t.IdleRatio());
+  fprintf(f, "  \"mean_path_length\": %.2f,\n", t.MeanPathLength());
+  fprintf(f, "  \"step_cap_hits\": %lld,\n", (long long) t.step_cap_hits);
+  if (w.pager.enabled) {
+    fprintf(f, "  \"paging\": {\"evicted_chunks\": %d, \"evictions\": %lld, \"page_ins\": %lld, \"page_file_bytes\": %llu},\n",
+            (int) w.pager.evicted.size(), (long long) w.pager.evictions, (long long) w.pager.page_ins,
+            (unsigned long long) w.pager.file.end);
+  }
+  fprintf(f, "  \"memory\": {\n");
+  MemoryStats total_start;
+  for (int i = 0; i < MEMORY_TAG_COUNT; ++i) {
+    WriteMemoryStats(f, memory_tag_names[i], GetMemoryStats(MemoryTag(i)), memory_start[i], ticks, false);
+    total_start.allocated += memory_start[i].allocated;
+  }
+  WriteMemoryStats(f, "total", GetTotalMemoryStats(), total_start, ticks, true);
+  fprintf(f, "  },\n");
+  fprintf(f, "  \"final_hash\": \"%016llx\"\n", (unsigned long long) WorldHash(w));
+  fprintf(f, "}\n");
+}
+
+int main(int argc, char **argv) {
+  if (const char *path = getenv("BB_TRACE"))
+    StartTrace(path);
+  FILE *stats_csv = nullptr;
+  string scenario_path, load_path, generator_spec, summary_path, record_path, replay_path, save_path, page_path;
+  int64_t evict_after = 1800;
+  int64_t ticks = -1;
+  bool until_idle = false, check_hash = false, check_search = false, seeded = false;
+  SearchEngine search_engine = SEARCH_FAST;
+  uint64_t seed = 0;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--scenario" && i + 1 < argc) {
+      scenario_path = argv[++i];
+    } else if (arg == "--load" && i + 1 < argc) {
+      load_path = argv[++i];
+    } else if (arg == "--generate" && i + 1 < argc) {
+      generator_spec = argv[++i];
+    } else if (arg == "--ticks" && i + 1 < argc) {
+      ticks = atoll(argv[++i]);
+    } else if (arg == "--until-idle") {
+      until_idle = true;
+    } else if (arg == "--seed" && i + 1 < argc) {
+      seed = strtoull(argv[++i], nullptr, 0);
+      seeded = true;
+    } else if (arg == "--summary" && i + 1 < argc) {
+      summary_path = argv[++i];
+    } else if (arg == "--stats" && i + 1 < argc) {
+      stats_csv = fopen(argv[++i], "w");
+      if (stats_csv == nullptr) {
+        fprintf(stderr, "Failed to open %s\n", argv[i]);
+        return 1;
+      }
+      WriteSearchStatsCsvHeader(stats_csv);
+    } else if (arg == "--trace" && i + 1 < argc) {
+      StartTrace(argv[++i]);
+    } else if (arg == "--record" && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (arg == "--save" && i + 1 < argc) {
+      save_path = argv[++i];
+    } else if (arg == "--check-hash") {
+      check_hash = true;
+    } else if (arg == "--search" && i + 1 < argc) {
+      if (!ParseSearchEngine(argv[++i], search_engine))
+        return 1;
+    } else if (arg == "--page-file" && i + 1 < argc) {
+      page_path = argv[++i];
+    } else if (arg == "--evict-after" && i + 1 < argc) {
+      evict_after = atoll(argv[++i]);
+    } else if (arg == "--check-search") {
+      check_search = true;
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  TraceThreadName("main");
+
+  if (!replay_path.empty()) {
+    bool match = RunReplay(world, replay_path);
+    if (trace_enabled)
+      WriteTrace(trace_path);
+    return match ? 0 : 2;
+  }
+
+  WorldGenParams generator;
+  if (!generator_spec.empty()) {
+    if (!ParseWorldGenParams(generator_spec, generator))
+      return 1;
+    generator_spec = FormatWorldGenParams(generator);
+  }
+  if (seeded)
+    world.rng.Seed(seed);
+  if (!load_path.empty() && !LoadSnapshot(world, load_path))
+    return 1;
+  if (!record_path.empty() && !StartRecording(world, record_path, load_path, generator_spec))
+    return 1;
+  ScenarioSettings scenario;
+  if (!generator_spec.empty())
+    GenerateWorld(world, generator);
+  else if (!scenario_path.empty()) {
+    if (!LoadScenario(world, scenario_path, scenario))
+      return 1;
+  } else if (load_path.empty())
+    BuildScene(world);
+  if (ticks < 0)
+    ticks = scenario.ticks >= 0 ? scenario.ticks : 1000;
+  world.search_engine = search_engine;
+  if (!page_path.empty() && !EnablePaging(world, page_path, evict_after))
+    return 1;
+
+  const char *stop_reason = "ticks";
+  int64_t ran = 0;
+  MemoryStats memory_start[MEMORY_TAG_COUNT];
+  for (int i = 0; i < MEMORY_TAG_COUNT; ++i) memory_start[i] = GetMemoryStats(MemoryTag(i));
+  auto start = chrono::steady_clock::now();
+  while (ran < ticks) {
+    if (check_search && !CheckSearchTick(world, "search_divergence.bbs")) {
+      stop_reason = "divergence";
+      break;
+    }
+    TraceScope tick("tick");
+    Tick(world);
+    ++ran;
+    if (stats_csv)
+      WriteSearchStatsCsv(stats_csv, world.tick_stats);
+    if (check_hash) {
+      uint64_t incremental = WorldHash(world);
+      if (RecomputeWorldHash(world) != incremental)
+        fprintf(stderr, "Tick %lld: incremental world hash diverged\n", (long long) world.tick_number);
+    }
+    if (until_idle && WorldIdle(world)) {
+      stop_reason = "idle";
+      break;
+    }
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  FILE *summary = stdout;
+  if (!summary_path.empty() && (summary = fopen(summary_path.c_str(), "w")) == nullptr) {
+    fprintf(stderr, "Failed to open %s\n", summary_path.c_str());
+    return 1;
+  }
+  WriteSummary(summary, world, ran, seconds, stop_reason, memory_start);
+  if (summary != stdout)
+    fclose(summary);
+
+  StopRecording(world);
+  if (!save_path.empty())
+    SaveSnapshot(world, save_path);
+  if (stats_csv)
+    fclose(stats_csv);
+  if (trace_enabled)
+    WriteTrace(trace_path);
+  return strcmp(stop_reason, "divergence") == 0 ? 1 : 0;
+}
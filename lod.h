@@ -0,0 +1,69 @@
+#ifndef BUNKERBUILDER_LOD_H
+#define BUNKERBUILDER_LOD_H
+
+#include <cstdint>
+#include "game.h"
+
+/**
+ * Per-chunk summaries for far zoom and the minimap.
+ *
+ * A summary counts the structures of each type in a CHUNK_SIZE x CHUNK_SIZE chunk. When the
+ * camera is zoomed far out, a chunk is drawn as one rectangle in the average color of its
+ * cells, and the minimap is one pixel per chunk.
+ */
+
+namespace bb {
+
+const int STRUCTURE_TYPE_COUNT = MUSHROOM_FARM + 1;
+
+struct ChunkSummary {
+  uint16_t structures[STRUCTURE_TYPE_COUNT] = {};
+
+  int Total() const {
+    int total = 0;
+    for (int i = 1; i < STRUCTURE_TYPE_COUNT; ++i) total += structures[i];
+    return total;
+  }
+};
+
+struct Rgb {
+  uint8_t r, g, b;
+};
+
+// Roughly the average colors of the tile textures.
+const Rgb sky_color = {120, 170, 220};
+const Rgb structure_colors[STRUCTURE_TYPE_COUNT] = {
+    [NONE] = {92, 64, 44},
+    [STAIRCASE] = {150, 120, 90},
+    [CORRIDOR] = {170, 150, 120},
+    [MUSHROOM_FARM] = {110, 150, 80},
+};
+
+// Cells without a structure are sky above the surface and ground below it.
+Rgb ChunkColor(const Cell &chunk, const ChunkSummary *summary) {
+  const int cells = CHUNK_SIZE * CHUNK_SIZE;
+  int first_row = chunk.row * CHUNK_SIZE;
+  int sky_rows = first_row > 0 ? 0 : first_row + CHUNK_SIZE <= 1 ? CHUNK_SIZE : 1 - first_row;
+  int sky = sky_rows * CHUNK_SIZE;
+  int r = sky * sky_color.r, g = sky * sky_color.g, b = sky * sky_color.b;
+  int empty = cells - sky;
+  if (summary) {
+    for (int i = 1; i < STRUCTURE_TYPE_COUNT; ++i) {
+      int n = summary->structures[i];
+      r += n * structure_colors[i].r;
+      g += n * structure_colors[i].g;
+      b += n * structure_colors[i].b;
+      empty -= n;
+    }
+  }
+  if (empty > 0) {
+    r += empty * structure_colors[NONE].r;
+    g += empty * structure_colors[NONE].g;
+    b += empty * structure_colors[NONE].b;
+  }
+  return Rgb{uint8_t(r / cells), uint8_t(g / cells), uint8_t(b / cells)};
+}
+
+}
+
+#endif //BUNKERBUILDER_LOD_H
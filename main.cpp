@@ -1,6 +1,8 @@
 #define SDL
 
 #include <cstdio>
+#include <cstdlib>
+#include <chrono>
 
 #ifdef SDL
 #include <SDL2/SDL.h>
@@ -8,6 +10,11 @@
 
 #include "namegen.h"
 #include "game.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "batch.h"
+#include "worldgen.h"
+#include "scenario.h"
 
 #ifdef SDL
 #include "sdl.h"
@@ -16,33 +23,169 @@
 using namespace std;
 using namespace bb;
 
-int main() {
+int main(int argc, char **argv) {
+  if (const char *path = getenv("BB_TRACE"))
+    StartTrace(path);
+  FILE *stats_csv = nullptr;
+  string load_path, save_path, record_path, replay_path, export_path;
+  string generator_spec, page_path;
+  WorldGenParams generator;
+  int64_t evict_after = 1800;
+  bool check_hash = false;
+  int batch = 0;
+  int ticks = 30;
+  uint64_t seed = 0;
+  bool seeded = false;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--trace" && i + 1 < argc) {
+      StartTrace(argv[++i]);
+    } else if (arg == "--stats" && i + 1 < argc) {
+      stats_csv = fopen(argv[++i], "w");
+      if (stats_csv == nullptr) {
+        fprintf(stderr, "Failed to open %s\n", argv[i]);
+        return 1;
+      }
+      WriteSearchStatsCsvHeader(stats_csv);
+    } else if (arg == "--load" && i + 1 < argc) {
+      load_path = argv[++i];
+    } else if (arg == "--save" && i + 1 < argc) {
+      save_path = argv[++i];
+    } else if (arg == "--record" && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (arg == "--generate" && i + 1 < argc) {
+      generator_spec = argv[++i];
+      if (!ParseWorldGenParams(generator_spec, generator))
+        return 1;
+      generator_spec = FormatWorldGenParams(generator);
+    } else if (arg == "--export" && i + 1 < argc) {
+      export_path = argv[++i];
+    } else if (arg == "--page-file" && i + 1 < argc) {
+      page_path = argv[++i];
+    } else if (arg == "--evict-after" && i + 1 < argc) {
+      evict_after = atoll(argv[++i]);
+    } else if (arg == "--check-hash") {
+      check_hash = true;
+    } else if (arg == "--batch" && i + 1 < argc) {
+      batch = atoi(argv[++i]);
+    } else if (arg == "--ticks" && i + 1 < argc) {
+      ticks = atoi(argv[++i]);
+    } else if (arg == "--seed" && i + 1 < argc) {
+      seed = strtoull(argv[++i], nullptr, 0);
+      seeded = true;
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  TraceThreadName("main");
+
+  if (!replay_path.empty()) {
+    bool match = RunReplay(world, replay_path);
+    if (trace_enabled)
+      WriteTrace(trace_path);
+    return match ? 0 : 2;
+  }
+
+  if (batch > 0) {
+    vector<World *> worlds;
+    for (int i = 0; i < batch; ++i) worlds.push_back(new World());
+    SeedWorlds(worlds, seed);
+    for (World *w : worlds) {
+      if (!generator_spec.empty()) {
+        // Each world gets its own layout - the spec's seed mixed with the world's stream.
+        WorldGenParams params = generator;
+        params.seed ^= uint64_t(w->rng.u32()) << 32 | w->rng.u32();
+        GenerateWorld(*w, params);
+      } else if (load_path.empty())
+        BuildScene(*w);
+      else if (!LoadSnapshot(*w, load_path))
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    RunWorlds(worlds, ticks);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("Simulated %d worlds x %d ticks in %.3f s (%.0f ticks/s)\n", batch, ticks, seconds,
+           seconds > 0 ? batch * ticks / seconds : 0.);
+    for (int i = 0; i < batch; ++i) {
+      printf("World %d: hash %016llx\n", i, (unsigned long long) WorldHash(*worlds[i]));
+      delete worlds[i];
+    }
+    if (trace_enabled)
+      WriteTrace(trace_path);
+    return 0;
+  }
+
+  // Writes the starting world (e.g. a generated one) to a snapshot without running it.
+  if (!export_path.empty()) {
+    if (seeded)
+      world.rng.Seed(seed);
+    if (!load_path.empty() && !LoadSnapshot(world, load_path))
+      return 1;
+    if (!generator_spec.empty())
+      GenerateWorld(world, generator);
+    else if (load_path.empty())
+      BuildScene(world);
+    return SaveSnapshot(world, export_path) ? 0 : 1;
+  }
+
 #ifdef SDL
   if (!Init())
     return 1;
 #endif
 
-  dwarves.insert(Dwarf::MakeRandom(0, 2));
-//  dwarves.insert(Dwarf::MakeRandom(2, 5));
-  AddStructure(1, 5, Structure::New(STAIRCASE));
-  AddStructure(2, 5, Structure::New(STAIRCASE));
-  AddStructure(3, 5, Structure::New(STAIRCASE));
-  AddStructure(3, 4, Structure::New(CORRIDOR));
-  AddStructure(3, 3, Structure::New(CORRIDOR));
-  AddStructure(3, 2, Structure::New(MUSHROOM_FARM));
-  AddItem(Point(100, 800), SPORE);
+  if (seeded)
+    world.rng.Seed(seed);
+  if (!load_path.empty() && !LoadSnapshot(world, load_path))
+    return 1;
+  if (!record_path.empty() && !StartRecording(world, record_path, load_path, generator_spec))
+    return 1;
+  if (!generator_spec.empty())
+    GenerateWorld(world, generator);
+  else if (load_path.empty())
+    BuildScene(world);
+  if (!page_path.empty() && !EnablePaging(world, page_path, evict_after))
+    return 1;
 
 #ifdef SDL
-  while (HandleInput()) {
-    Tick();
+  simulation_stats_csv = stats_csv;
+  simulation_check_hash = check_hash;
+  StartSimulation(world);
+  // While nothing changes the loop sleeps in HandleInput() until an event (or the
+  // simulation) wakes it up.
+  bool draw = true;
+  while (HandleInput(draw ? 0 : 500)) {
+    if (!(draw = UpdateRenderState()))
+      continue;
+    TraceScope frame("frame");
     Draw();
+    ProfileEndFrame();
   }
+  StopSimulation(world);
   SDL_Quit();
 #else
-  for (int i = 0; i < 30; ++i) {
+  for (int i = 0; i < ticks; ++i) {
     printf("Tick %d\n", i);
-    Tick();
+    TraceScope tick("tick");
+    Tick(world);
+    if (stats_csv)
+      WriteSearchStatsCsv(stats_csv, world.tick_stats);
+    if (check_hash) {
+      uint64_t incremental = WorldHash(world);
+      if (RecomputeWorldHash(world) != incremental)
+        fprintf(stderr, "Tick %d: incremental world hash diverged\n", i);
+    }
   }
 #endif
+  StopRecording(world);
+  if (!save_path.empty())
+    SaveSnapshot(world, save_path);
+  FinishSnapshotWrites();
+  if (stats_csv)
+    fclose(stats_csv);
+  if (trace_enabled)
+    WriteTrace(trace_path);
   return 0;
 }
@@ -0,0 +1,152 @@
+#ifndef BUNKERBUILDER_MEMORY_H
+#define BUNKERBUILDER_MEMORY_H
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+
+/**
+ * Memory accounting per subsystem.
+ *
+ * Containers tag their allocations with TrackedAllocator, objects through class-level
+ * operator new / delete, and anything else (pools, GPU textures) calls MemoryAlloc() and
+ * MemoryFree() itself. Every tag counts the bytes currently held, the peak and the total
+ * ever allocated - the total's growth over time is the allocation rate. Counters are shared
+ * by all worlds and threads of the process, except for allocations made inside an
+ * UntrackedMemoryScope.
+ */
+
+namespace bb {
+
+using namespace std;
+
+enum MemoryTag {
+  MEMORY_CELL_MAP = 0, // World::cells hash nodes and buckets
+  MEMORY_PLAN_MAP,
+  MEMORY_ITEM_MAP,
+  MEMORY_STRUCTURES,   // Structure objects
+  MEMORY_PLANS,        // the plan pool
+  MEMORY_ITEMS,
+  MEMORY_SEARCH,       // queues and trees of the job search, freed at the end of each tick
+  MEMORY_CHUNK_PAGES,  // what stays in memory of evicted chunks - see "Chunk paging" in game.h
+  MEMORY_TEXT_TEXTURES, // names, speech and overlay labels - estimated GPU bytes
+  MEMORY_TEXTURES,      // tiles, sprites, buttons and the minimap - estimated GPU bytes
+  MEMORY_TAG_COUNT
+};
+
+const char *memory_tag_names[MEMORY_TAG_COUNT] = {
+    "cell_map", "plan_map", "item_map", "structures", "plans", "items", "search", "chunk_pages", "text_textures",
+    "textures"
+};
+
+struct MemoryCounter {
+  atomic<int64_t> current{0};
+  atomic<int64_t> peak{0};
+  atomic<int64_t> allocated{0};
+  atomic<int64_t> allocations{0};
+};
+
+MemoryCounter memory_counters[MEMORY_TAG_COUNT];
+thread_local int memory_untracked = 0;
+
+// Leaves the thread's allocations out of the counters while it lives - for scratch worlds
+// like the search checker's (oracle.h). Memory allocated in a scope must be freed in one.
+struct UntrackedMemoryScope {
+  UntrackedMemoryScope() { ++memory_untracked; }
+  ~UntrackedMemoryScope() { --memory_untracked; }
+};
+
+void MemoryAlloc(MemoryTag tag, int64_t bytes) {
+  if (memory_untracked) return;
+  MemoryCounter &c = memory_counters[tag];
+  int64_t current = c.current.fetch_add(bytes, memory_order_relaxed) + bytes;
+  int64_t peak = c.peak.load(memory_order_relaxed);
+  while (current > peak && !c.peak.compare_exchange_weak(peak, current, memory_order_relaxed)) {}
+  c.allocated.fetch_add(bytes, memory_order_relaxed);
+  c.allocations.fetch_add(1, memory_order_relaxed);
+}
+
+void MemoryFree(MemoryTag tag, int64_t bytes) {
+  if (memory_untracked) return;
+  memory_counters[tag].current.fetch_sub(bytes, memory_order_relaxed);
+}
+
+struct MemoryStats {
+  int64_t current = 0;
+  int64_t peak = 0;
+  int64_t allocated = 0; // since the start - diff two samples for the rate
+  int64_t allocations = 0;
+};
+
+MemoryStats GetMemoryStats(MemoryTag tag) {
+  const MemoryCounter &c = memory_counters[tag];
+  MemoryStats s;
+  s.current = c.current.load(memory_order_relaxed);
+  s.peak = c.peak.load(memory_order_relaxed);
+  s.allocated = c.allocated.load(memory_order_relaxed);
+  s.allocations = c.allocations.load(memory_order_relaxed);
+  return s;
+}
+
+// Sum over all tags. The peak is the sum of the tags' peaks, which may not have coincided.
+MemoryStats GetTotalMemoryStats() {
+  MemoryStats total;
+  for (int i = 0; i < MEMORY_TAG_COUNT; ++i) {
+    MemoryStats s = GetMemoryStats(MemoryTag(i));
+    total.current += s.current;
+    total.peak += s.peak;
+    total.allocated += s.allocated;
+    total.allocations += s.allocations;
+  }
+  return total;
+}
+
+template<class T, MemoryTag tag>
+struct TrackedAllocator {
+  typedef T value_type;
+
+  template<class U>
+  struct rebind {
+    typedef TrackedAllocator<U, tag> other;
+  };
+
+  TrackedAllocator() = default;
+
+  template<class U>
+  TrackedAllocator(const TrackedAllocator<U, tag> &) {}
+
+  T *allocate(size_t n) {
+    MemoryAlloc(tag, int64_t(n * sizeof(T)));
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) {
+    MemoryFree(tag, int64_t(n * sizeof(T)));
+    ::operator delete(p);
+  }
+
+  template<class U>
+  bool operator==(const TrackedAllocator<U, tag> &) const { return true; }
+
+  template<class U>
+  bool operator!=(const TrackedAllocator<U, tag> &) const { return false; }
+};
+
+// Base for objects counted under one tag. Deleting through a base pointer charges the base's
+// size, so derived classes shouldn't add members.
+template<MemoryTag tag>
+struct Tracked {
+  static void *operator new(size_t size) {
+    MemoryAlloc(tag, int64_t(size));
+    return ::operator new(size);
+  }
+
+  static void operator delete(void *p, size_t size) {
+    MemoryFree(tag, int64_t(size));
+    ::operator delete(p);
+  }
+};
+
+}
+
+#endif //BUNKERBUILDER_MEMORY_H
@@ -14,13 +14,13 @@ namespace bb {
         vector<string> suffixes = {"", "us", "ix", "ox", "ith", "ath", "um", "ator", "or", "axia", "imus", "ais",
                                    "itur", "orex", "o", "y"};
 
-        string choice(const vector<string> &choices) {
-            uint64_t index = random::u32() % choices.size();
+        string choice(random::Rng &rng, const vector<string> &choices) {
+            uint64_t index = rng.u32() % choices.size();
             return choices[index];
         }
 
-        string gen() {
-            string name = choice(prefixes) + choice(stems) + choice(suffixes);
+        string gen(random::Rng &rng = random::global) {
+            string name = choice(rng, prefixes) + choice(rng, stems) + choice(rng, suffixes);
             name[0] = (char)toupper(name[0]);
             return name;
         }
@@ -0,0 +1,128 @@
+#ifndef BUNKERBUILDER_ORACLE_H
+#define BUNKERBUILDER_ORACLE_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "game.h"
+#include "snapshot.h"
+
+/**
+ * Differential check of the job search.
+ *
+ * Before a tick, the world is copied twice through a snapshot. One copy is ticked with
+ * SEARCH_REFERENCE, the other with SEARCH_FAST, and the assignments of every dwarf -
+ * plan, structure, assigned item, first step and position - are compared. The first
+ * divergence is reported together with the cells around the dwarf, and the snapshot it
+ * started from is saved so that it can be reproduced with --load. The copies stay out of the
+ * memory counters, so a checked run reports the same memory use as an unchecked one.
+ */
+
+namespace bb {
+
+using namespace std;
+
+World oracle_reference, oracle_candidate;
+
+const char *SearchEngineName(SearchEngine engine) {
+  return engine == SEARCH_REFERENCE ? "reference" : "fast";
+}
+
+bool ParseSearchEngine(const string &name, SearchEngine &engine) {
+  if (name == "reference")
+    engine = SEARCH_REFERENCE;
+  else if (name == "fast")
+    engine = SEARCH_FAST;
+  else {
+    fprintf(stderr, "Unknown search engine: %s\n", name.c_str());
+    return false;
+  }
+  return true;
+}
+
+void PrintAssignment(FILE *f, const char *label, const DwarfAssignment &a) {
+  fprintf(f, "  %-9s pos %d,%d  step %d,%d", label, a.pos.y, a.pos.x, a.waypoint.y, a.waypoint.x);
+  if (a.plan || a.structure)
+    fprintf(f, "  %s at %d-%d", a.plan ? "plan" : "structure", a.destination.row, a.destination.col);
+  if (a.has_item) fprintf(f, "  item at %d,%d", a.item_pos.y, a.item_pos.x);
+  fprintf(f, "\n");
+}
+
+// Prints the cells within `radius` of `center`, plus the plans, items and dwarves in them.
+void DumpRegion(FILE *f, const World &w, const Cell &center, int radius) {
+  static const char structure_chars[] = " SCF";
+  static const char plan_chars[] = " scf";
+  fprintf(f, "  cells %d-%d .. %d-%d (# ground, S/C/F staircase/corridor/farm, s/c/f plans, * items):\n",
+          center.row - radius, center.col - radius, center.row + radius, center.col + radius);
+  for (int row = center.row - radius; row <= center.row + radius; ++row) {
+    fprintf(f, "  %4d ", row);
+    for (int col = center.col - radius; col <= center.col + radius; ++col) {
+      Cell c(row, col);
+      auto structure = w.cells.find(c);
+      auto plan = w.plans.find(c);
+      char ch = row <= 0 ? '.' : '#';
+      if (structure != w.cells.end()) ch = structure_chars[structure->second->type];
+      if (plan != w.plans.end()) ch = plan_chars[plan->second->structure_type];
+      if (w.items.count(c)) ch = '*';
+      fputc(c == center ? '[' : ' ', f);
+      fputc(ch, f);
+      fputc(c == center ? ']' : ' ', f);
+    }
+    fprintf(f, "\n");
+  }
+  auto near = [&](const Cell &c) {
+    return abs(c.row - center.row) <= radius && abs(c.col - center.col) <= radius;
+  };
+  for (auto &p : w.plans)
+    if (near(p.first))
+      fprintf(f, "  plan %d-%d type %d progress %.2f\n", p.first.row, p.first.col, p.second->structure_type,
+              p.second->progress);
+  for (auto &p : w.items)
+    if (near(p.first)) fprintf(f, "  item %d,%d type %d\n", p.second->pos.y, p.second->pos.x, p.second->def->type);
+  for (Dwarf *d : w.dwarves)
+    if (near(Cell(d->pos)))
+      fprintf(f, "  dwarf %d %s at %d,%d%s\n", d->id, d->name.c_str(), d->pos.y, d->pos.x,
+              d->item ? " carrying an item" : "");
+}
+
+// Runs the next tick of `w` with both engines on copies. Returns false, after printing a
+// report, if they disagree. `w` itself isn't changed.
+bool CheckSearchTick(const World &w, const string &dump_path) {
+  UntrackedMemoryScope untracked;
+  vector<char> data = SerializeWorld(w);
+  World *worlds[2] = {&oracle_reference, &oracle_candidate};
+  const SearchEngine engines[2] = {SEARCH_REFERENCE, SEARCH_FAST};
+  for (int i = 0; i < 2; ++i) {
+    if (!BuildWorld(*worlds[i], data.data(), data.size())) return false;
+    worlds[i]->search_engine = engines[i];
+    worlds[i]->record_assignments = true;
+    Tick(*worlds[i]);
+  }
+  const vector<DwarfAssignment> &expected = oracle_reference.assignments;
+  const vector<DwarfAssignment> &actual = oracle_candidate.assignments;
+  for (size_t i = 0; i < expected.size(); ++i) {
+    const DwarfAssignment &a = expected[i], &b = actual[i];
+    bool same = a.plan == b.plan && a.structure == b.structure && a.has_item == b.has_item &&
+                (!(a.plan || a.structure) || a.destination == b.destination) &&
+                (!a.has_item || (a.item_pos.y == b.item_pos.y && a.item_pos.x == b.item_pos.x)) &&
+                a.waypoint.y == b.waypoint.y && a.waypoint.x == b.waypoint.x && a.pos.y == b.pos.y &&
+                a.pos.x == b.pos.x;
+    if (same) continue;
+    fprintf(stderr, "Search engines diverged in tick %lld at dwarf %d:\n", (long long) w.tick_number, a.id);
+    PrintAssignment(stderr, SearchEngineName(SEARCH_REFERENCE), a);
+    PrintAssignment(stderr, SearchEngineName(SEARCH_FAST), b);
+    BuildWorld(oracle_reference, data.data(), data.size());
+    Cell center(a.pos);
+    for (Dwarf *d : oracle_reference.dwarves)
+      if (d->id == a.id) center = Cell(d->pos);
+    DumpRegion(stderr, oracle_reference, center, 3);
+    if (!dump_path.empty() && WriteSnapshotFile(dump_path, data))
+      fprintf(stderr, "  world before the tick saved to %s\n", dump_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}
+
+#endif //BUNKERBUILDER_ORACLE_H
@@ -0,0 +1,153 @@
+#ifndef BUNKERBUILDER_PAGING_H
+#define BUNKERBUILDER_PAGING_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Page file - scratch storage for records of any size, used to evict idle chunks of the
+ * world (see "Chunk paging" in game.h).
+ *
+ * Write() puts a record into the smallest free extent that fits it, or at the end of the
+ * file, and Free() hands the extent back, merged with free neighbours - a free extent at the
+ * end of the file is cut off. Extents are rounded up to PAGE_GRANULE bytes so that freed
+ * ones are easy to reuse. The file is unlinked right after it is opened - it
+ * goes away with the process and never has to be cleaned up.
+ */
+
+namespace bb {
+
+using namespace std;
+
+const uint64_t PAGE_GRANULE = 256;
+
+struct PageFile {
+  int fd = -1;
+  uint64_t end = 0;                           // file size
+  multimap<uint64_t, uint64_t> free_extents;  // size -> offset
+  map<uint64_t, uint64_t> free_offsets;       // offset -> size, same extents
+
+  PageFile() = default;
+  PageFile(const PageFile &) = delete;
+  PageFile &operator=(const PageFile &) = delete;
+
+  ~PageFile() {
+    Close();
+  }
+
+  static uint64_t ExtentSize(uint64_t size) {
+    return (size + PAGE_GRANULE - 1) / PAGE_GRANULE * PAGE_GRANULE;
+  }
+
+  bool Open(const string &path) {
+    Close();
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open page file %s\n", path.c_str());
+      return false;
+    }
+    unlink(path.c_str());
+    return true;
+  }
+
+  void Close() {
+    if (fd >= 0) close(fd);
+    fd = -1;
+    end = 0;
+    free_extents.clear();
+    free_offsets.clear();
+  }
+
+  // Drops all records.
+  void Reset() {
+    if (fd >= 0 && ftruncate(fd, 0) != 0) fprintf(stderr, "Failed to truncate the page file\n");
+    end = 0;
+    free_extents.clear();
+    free_offsets.clear();
+  }
+
+  void AddFreeExtent(uint64_t offset, uint64_t size) {
+    free_extents.emplace(size, offset);
+    free_offsets.emplace(offset, size);
+  }
+
+  void RemoveFreeExtent(uint64_t offset, uint64_t size) {
+    auto range = free_extents.equal_range(size);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == offset) {
+        free_extents.erase(it);
+        break;
+      }
+    }
+    free_offsets.erase(offset);
+  }
+
+  bool Write(const vector<char> &data, uint64_t &offset) {
+    uint64_t size = ExtentSize(data.size());
+    auto it = free_extents.lower_bound(size);
+    if (it != free_extents.end()) {
+      offset = it->second;
+      uint64_t rest = it->first - size;
+      free_extents.erase(it);
+      free_offsets.erase(offset);
+      if (rest > 0) AddFreeExtent(offset + size, rest);
+    } else {
+      offset = end;
+      end += size;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n = pwrite(fd, data.data() + written, data.size() - written, off_t(offset + written));
+      if (n <= 0) {
+        Free(offset, data.size());
+        return false;
+      }
+      written += size_t(n);
+    }
+    return true;
+  }
+
+  bool Read(uint64_t offset, char *data, size_t size) const {
+    size_t done = 0;
+    while (done < size) {
+      ssize_t n = pread(fd, data + done, size - done, off_t(offset + done));
+      if (n <= 0) return false;
+      done += size_t(n);
+    }
+    return true;
+  }
+
+  // `size` is the size the record was written with.
+  void Free(uint64_t offset, uint64_t size) {
+    size = ExtentSize(size);
+    auto next = free_offsets.lower_bound(offset);
+    if (next != free_offsets.end() && next->first == offset + size) {
+      size += next->second;
+      RemoveFreeExtent(next->first, next->second);
+    }
+    auto prev = free_offsets.lower_bound(offset);
+    if (prev != free_offsets.begin()) {
+      --prev;
+      if (prev->first + prev->second == offset) {
+        offset = prev->first;
+        size += prev->second;
+        RemoveFreeExtent(prev->first, prev->second);
+      }
+    }
+    if (offset + size == end) {
+      end = offset;
+      if (ftruncate(fd, off_t(end)) != 0) fprintf(stderr, "Failed to truncate the page file\n");
+      return;
+    }
+    AddFreeExtent(offset, size);
+  }
+};
+
+}
+
+#endif //BUNKERBUILDER_PAGING_H
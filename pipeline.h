@@ -0,0 +1,338 @@
+#ifndef BUNKERBUILDER_PIPELINE_H
+#define BUNKERBUILDER_PIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "game.h"
+#include "lod.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "trace.h"
+
+/**
+ * Simulation / render pipeline.
+ *
+ * The simulation runs on its own thread at a fixed tick rate. After each tick it copies what
+ * Draw() needs into a RenderFrame and publishes it through a triple buffer, so the renderer
+ * always picks up the newest finished frame and neither side waits for the other. Edits
+ * travel the other way through single-producer single-consumer queues and are applied
+ * between ticks - the renderer never touches the World while the simulation runs.
+ */
+
+namespace bb {
+
+using namespace std;
+
+template<class T>
+struct TripleBuffer {
+  static const int FRESH = 4;
+
+  T buffers[3];
+  // Buffer parked between the writer and the reader, plus FRESH if the reader hasn't seen it.
+  atomic<int> middle{1};
+  int back = 0;  // writer's
+  int front = 2; // reader's
+
+  T &Back() { return buffers[back]; }
+
+  int BackIndex() const { return back; }
+
+  void Publish() {
+    back = middle.exchange(back | FRESH, memory_order_acq_rel) & 3;
+  }
+
+  // Switches to the newest published buffer. Returns false if nothing new was published.
+  bool Update() {
+    if (!(middle.load(memory_order_relaxed) & FRESH)) return false;
+    front = middle.exchange(front, memory_order_acq_rel) & 3;
+    return true;
+  }
+
+  const T &Front() const { return buffers[front]; }
+};
+
+template<class T, size_t N>
+struct SpscQueue {
+  T items[N];
+  atomic<size_t> head{0}; // next to pop
+  atomic<size_t> tail{0}; // next to push
+
+  bool Push(const T &item) {
+    size_t t = tail.load(memory_order_relaxed);
+    if (t - head.load(memory_order_acquire) == N) return false;
+    items[t % N] = item;
+    tail.store(t + 1, memory_order_release);
+    return true;
+  }
+
+  bool Pop(T &item) {
+    size_t h = head.load(memory_order_relaxed);
+    if (h == tail.load(memory_order_acquire)) return false;
+    item = move(items[h % N]);
+    head.store(h + 1, memory_order_release);
+    return true;
+  }
+};
+
+struct RenderDwarf {
+  int id;
+  Point pos;
+  string name;
+  ItemType item = NO_ITEM_TYPE; // carried - drawn at `pos`, not among the frame's items
+};
+
+struct RenderItem {
+  Point pos;
+  ItemType type;
+};
+
+struct RenderPlan {
+  StructureType structure_type;
+  double progress;
+};
+
+struct RenderFrame {
+  int64_t tick_number = 0;
+  uint64_t world_hash = 0;
+  int64_t plans_version = -1; // World::plans_version `plans` was copied at
+  int64_t items_version = -1;
+  int64_t dwarves_version = -1; // names are only copied when it changes
+  int money = 0;
+  unordered_map<Cell, StructureType> cells;
+  unordered_map<Cell, ChunkSummary> chunks; // summaries of `cells`, keyed by ChunkOf()
+  int64_t cells_version = -1;               // position in the structure change log
+  unordered_map<Cell, RenderPlan> plans;
+  vector<RenderItem> items; // lying ones
+  vector<RenderDwarf> dwarves;
+};
+
+struct SpeechEvent {
+  int dwarf_id;
+  const char *text; // nullptr - the oldest text of this dwarf expired
+};
+
+TripleBuffer<RenderFrame> render_frames;
+SpscQueue<WorldCommand, 1024> world_commands;  // input -> simulation
+SpscQueue<string, 16> snapshot_requests;       // input -> simulation, paths to save to
+SpscQueue<SpeechEvent, 1024> speech_events;    // simulation -> renderer
+
+double simulation_tick_rate = 60;
+// Called on the simulation thread when there is something new to draw, so that the renderer
+// can sleep while the colony is idle.
+void (*wake_renderer)() = nullptr;
+atomic<bool> simulation_running{false};
+// Set before StartSimulation(). Written by the simulation thread after every tick.
+FILE *simulation_stats_csv = nullptr;
+bool simulation_check_hash = false;
+thread simulation_thread;
+// Chunks the camera shows - first row, first col, last row, last col - set by the renderer.
+// RunSimulation() keeps them resident so that their plans and items reach the RenderFrame.
+// A view torn between two updates only pages in a few chunks too many for one tick.
+atomic<int> paging_view[4] = {{0}, {0}, {-1}, {-1}};
+
+// How far each RenderFrame has caught up with a change log of the World.
+struct ChangeLogSync {
+  int64_t synced[3] = {-1, -1, -1}; // log index up to which each frame is up to date
+  int64_t base = 0;                 // index of the log's first entry
+
+  int64_t End(const vector<Cell> &log) const { return base + (int64_t) log.size(); }
+
+  // Drops the changes all frames have seen. A frame that falls too far behind gets a full copy.
+  void Trim(vector<Cell> &log) {
+    int64_t end = End(log);
+    int64_t oldest = *min_element(synced, synced + 3);
+    if (end - oldest > 65536) oldest = end;
+    if (oldest > base) {
+      log.erase(log.begin(), log.begin() + (oldest - base));
+      base = oldest;
+    }
+  }
+
+  void Reset(vector<Cell> &log) {
+    log.clear();
+    base = 0;
+    fill(synced, synced + 3, -1);
+  }
+};
+
+ChangeLogSync structure_sync; // World::structure_changes -> RenderFrame::cells
+ChangeLogSync plan_sync;      // World::plan_changes -> RenderFrame::plans
+vector<const Item *> carried_items; // scratch for PublishRenderFrame()
+// What the last published frame showed - to tell whether the renderer needs waking.
+uint64_t published_hash = 0;
+int published_money = 0;
+int64_t published_cells_version = -1;
+
+// Called from the renderer. An empty range (first after last) keeps nothing resident.
+void SetPagingView(const Cell &first, const Cell &last) {
+  paging_view[0].store(first.row, memory_order_relaxed);
+  paging_view[1].store(first.col, memory_order_relaxed);
+  paging_view[2].store(last.row, memory_order_relaxed);
+  paging_view[3].store(last.col, memory_order_relaxed);
+}
+
+// Sets a cell of the frame and keeps its chunk summary up to date. NONE removes it.
+void SetRenderCell(RenderFrame &frame, const Cell &cell, StructureType type) {
+  auto it = frame.cells.find(cell);
+  StructureType old_type = it == frame.cells.end() ? NONE : it->second;
+  if (old_type == type) return;
+  ChunkSummary &summary = frame.chunks[ChunkOf(cell)];
+  if (old_type != NONE) --summary.structures[old_type];
+  if (type != NONE) {
+    ++summary.structures[type];
+    frame.cells[cell] = type;
+  } else {
+    frame.cells.erase(it);
+  }
+}
+
+void PublishRenderFrame(World &w) {
+  int index = render_frames.BackIndex();
+  RenderFrame &frame = render_frames.Back();
+  frame.tick_number = w.tick_number;
+  frame.world_hash = WorldHash(w);
+  frame.money = w.money;
+
+  int64_t end = structure_sync.End(w.structure_changes);
+  if (structure_sync.synced[index] < structure_sync.base) {
+    frame.cells.clear();
+    frame.chunks.clear();
+    for (auto &p : w.cells) SetRenderCell(frame, p.first, p.second->type);
+    // Evicted chunks are still drawn - their structures come from the page file.
+    vector<char> record;
+    for (auto &p : w.pager.evicted) {
+      if (!ReadChunkRecord(w, p.second, record)) continue;
+      const ChunkRecord &header = *ChunkRecordArray<ChunkRecord>(record, 0);
+      const PagedStructure *structures = ChunkRecordArray<PagedStructure>(record, sizeof(ChunkRecord));
+      for (uint32_t i = 0; i < header.structures; ++i)
+        SetRenderCell(frame, Cell(structures[i].row, structures[i].col), (StructureType) structures[i].type);
+    }
+  } else {
+    for (size_t i = size_t(structure_sync.synced[index] - structure_sync.base); i < w.structure_changes.size(); ++i) {
+      const Cell &cell = w.structure_changes[i];
+      auto it = w.cells.find(cell);
+      SetRenderCell(frame, cell, it == w.cells.end() ? NONE : it->second->type);
+    }
+  }
+  structure_sync.synced[index] = end;
+  frame.cells_version = end;
+  structure_sync.Trim(w.structure_changes);
+
+  // Between plan edits only progress changes - the frame takes it from the cells logged since.
+  int64_t plans_end = plan_sync.End(w.plan_changes);
+  if (frame.plans_version != w.plans_version || plan_sync.synced[index] < plan_sync.base) {
+    frame.plans.clear();
+    for (auto &p : w.plans) frame.plans[p.first] = RenderPlan{p.second->structure_type, p.second->progress};
+    frame.plans_version = w.plans_version;
+  } else {
+    for (size_t i = size_t(plan_sync.synced[index] - plan_sync.base); i < w.plan_changes.size(); ++i) {
+      auto it = w.plans.find(w.plan_changes[i]);
+      if (it != w.plans.end()) frame.plans[it->first].progress = it->second->progress;
+    }
+  }
+  plan_sync.synced[index] = plans_end;
+  plan_sync.Trim(w.plan_changes);
+
+  if (frame.items_version != w.items_version) {
+    carried_items.clear();
+    for (Dwarf *d : w.dwarves)
+      if (d->item) carried_items.push_back(d->item);
+    sort(carried_items.begin(), carried_items.end());
+    frame.items.clear();
+    for (auto &p : w.items)
+      if (!binary_search(carried_items.begin(), carried_items.end(), p.second))
+        frame.items.push_back(RenderItem{p.second->pos, p.second->def->type});
+    frame.items_version = w.items_version;
+  }
+  if (frame.dwarves_version != w.dwarves_version) {
+    frame.dwarves.resize(w.dwarves.size());
+    size_t i = 0;
+    for (Dwarf *d : w.dwarves) {
+      frame.dwarves[i].id = d->id;
+      frame.dwarves[i++].name = d->name;
+    }
+    frame.dwarves_version = w.dwarves_version;
+  }
+  size_t i = 0;
+  for (Dwarf *d : w.dwarves) {
+    RenderDwarf &rd = frame.dwarves[i++];
+    rd.pos = d->pos;
+    rd.item = d->item ? d->item->def->type : NO_ITEM_TYPE;
+  }
+  bool changed = frame.world_hash != published_hash || frame.money != published_money ||
+                 frame.cells_version != published_cells_version;
+  published_hash = frame.world_hash;
+  published_money = frame.money;
+  published_cells_version = frame.cells_version;
+  render_frames.Publish();
+  if (changed && wake_renderer) wake_renderer();
+}
+
+// Called from the input thread. The command is applied before the next tick.
+void QueueWorldCommand(const WorldCommand &command) {
+  if (!world_commands.Push(command)) fprintf(stderr, "World command queue is full - dropping command\n");
+}
+
+void RunSimulation(World &w) {
+  TraceThreadName("simulation");
+  const auto period = chrono::nanoseconds(int64_t(1e9 / simulation_tick_rate));
+  auto next = chrono::steady_clock::now();
+  while (simulation_running.load(memory_order_acquire)) {
+    WorldCommand command;
+    while (world_commands.Pop(command)) ExecuteCommand(w, command);
+    string path;
+    while (snapshot_requests.Pop(path)) SaveSnapshotAsync(w, path);
+    if (w.pager.enabled) {
+      Cell first(paging_view[0].load(memory_order_relaxed), paging_view[1].load(memory_order_relaxed));
+      Cell last(paging_view[2].load(memory_order_relaxed), paging_view[3].load(memory_order_relaxed));
+      TouchArea(w, first, last);
+    }
+    {
+      TraceScope tick("tick");
+      Tick(w);
+    }
+    if (simulation_stats_csv) WriteSearchStatsCsv(simulation_stats_csv, w.tick_stats);
+    if (simulation_check_hash) {
+      uint64_t incremental = WorldHash(w);
+      if (RecomputeWorldHash(w) != incremental)
+        fprintf(stderr, "Tick %lld: incremental world hash diverged\n", (long long) w.tick_number);
+    }
+    PublishRenderFrame(w);
+    next += period;
+    auto now = chrono::steady_clock::now();
+    if (next < now)
+      next = now; // running behind - don't try to catch up
+    else
+      this_thread::sleep_until(next);
+  }
+}
+
+void QueueSpeech(World &, const WorldEvent &event, void *) {
+  speech_events.Push(SpeechEvent{event.dwarf_id, event.type == EVENT_DWARF_SAID ? event.text : nullptr});
+  if (wake_renderer) wake_renderer();
+}
+
+void StartSimulation(World &w) {
+  w.log_structure_changes = true;
+  PublishRenderFrame(w); // the first Draw() shouldn't have to wait for a tick
+  simulation_running = true;
+  simulation_thread = thread(RunSimulation, ref(w));
+}
+
+void StopSimulation(World &w) {
+  simulation_running = false;
+  if (simulation_thread.joinable()) simulation_thread.join();
+  w.log_structure_changes = false;
+  structure_sync.Reset(w.structure_changes);
+  plan_sync.Reset(w.plan_changes);
+}
+
+}
+
+#endif //BUNKERBUILDER_PIPELINE_H
@@ -0,0 +1,128 @@
+#ifndef BUNKERBUILDER_PROFILER_H
+#define BUNKERBUILDER_PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "trace.h"
+
+/**
+ * Frame profiler.
+ *
+ * Code is instrumented with ScopedTimers. Each timer charges the time until it goes out of
+ * scope to its phase. Nested timers pause their parent, so every phase reports exclusive
+ * time and the phases of a frame add up to (at most) the frame time.
+ *
+ * While a trace is being recorded, every timer also becomes a trace event.
+ *
+ * ProfileEndFrame() closes the current frame and moves its numbers into a rolling history
+ * which is shown by the debug overlay.
+ */
+
+namespace bb {
+
+using namespace std;
+
+enum ProfilePhase {
+  PROFILE_INPUT = 0,
+  PROFILE_SEARCH,
+  PROFILE_MOVEMENT,
+  PROFILE_DRAW_TILES,
+  PROFILE_DRAW_PLANS,
+  PROFILE_DRAW_DWARVES,
+  PROFILE_DRAW_ITEMS,
+  PROFILE_DRAW_LABELS,
+  PROFILE_DRAW_BUTTONS,
+  PROFILE_PRESENT,
+  PROFILE_PHASE_COUNT,
+  PROFILE_NO_PHASE = PROFILE_PHASE_COUNT
+};
+
+const char *profile_phase_names[PROFILE_PHASE_COUNT] = {
+    "input", "search", "movement", "tiles", "plans", "dwarves", "items", "labels", "buttons", "present"
+};
+
+typedef chrono::steady_clock ProfileClock;
+
+constexpr int PROFILE_HISTORY = 120;
+
+struct ProfileFrame {
+  int64_t total_ns;
+  int64_t phase_ns[PROFILE_PHASE_COUNT];
+};
+
+// Time charged to each phase during the frame that is still running. Timers may run on
+// any thread, so these are atomic.
+atomic<int64_t> profile_frame_ns[PROFILE_PHASE_COUNT];
+
+ProfileFrame profile_history[PROFILE_HISTORY];
+int profile_history_end = 0; // slot of the next finished frame
+int profile_history_size = 0;
+ProfileClock::time_point profile_frame_start = ProfileClock::now();
+
+// Innermost open timer of the calling thread.
+thread_local ProfilePhase profile_current = PROFILE_NO_PHASE;
+thread_local ProfileClock::time_point profile_since;
+
+void ProfileCharge(ProfilePhase phase, ProfileClock::time_point now) {
+  int64_t ns = chrono::duration_cast<chrono::nanoseconds>(now - profile_since).count();
+  profile_frame_ns[phase].fetch_add(ns, memory_order_relaxed);
+}
+
+struct ScopedTimer {
+  ProfilePhase phase, parent;
+  ProfileClock::time_point start;
+
+  ScopedTimer(ProfilePhase _phase) : phase(_phase), parent(profile_current), start(ProfileClock::now()) {
+    if (parent != PROFILE_NO_PHASE) ProfileCharge(parent, start);
+    profile_current = phase;
+    profile_since = start;
+  }
+
+  ~ScopedTimer() {
+    auto now = ProfileClock::now();
+    ProfileCharge(phase, now);
+    if (trace_enabled) {
+      TraceComplete(profile_phase_names[phase], TraceTime(start), TraceTime(now) - TraceTime(start));
+    }
+    profile_current = parent;
+    profile_since = now;
+  }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+};
+
+void ProfileEndFrame() {
+  auto now = ProfileClock::now();
+  ProfileFrame &frame = profile_history[profile_history_end];
+  frame.total_ns = chrono::duration_cast<chrono::nanoseconds>(now - profile_frame_start).count();
+  for (int i = 0; i < PROFILE_PHASE_COUNT; ++i) {
+    frame.phase_ns[i] = profile_frame_ns[i].exchange(0, memory_order_relaxed);
+  }
+  profile_frame_start = now;
+  profile_history_end = (profile_history_end + 1) % PROFILE_HISTORY;
+  if (profile_history_size < PROFILE_HISTORY) ++profile_history_size;
+}
+
+// Returns the n-th most recent finished frame (0 = last one).
+const ProfileFrame &ProfileRecentFrame(int n) {
+  return profile_history[(profile_history_end - 1 - n + 2 * PROFILE_HISTORY) % PROFILE_HISTORY];
+}
+
+// Average time of a phase over the last `frames` frames in milliseconds. Pass
+// PROFILE_NO_PHASE to get the whole frame time.
+double ProfileAverageMs(ProfilePhase phase, int frames) {
+  frames = min(frames, profile_history_size);
+  if (frames == 0) return 0;
+  int64_t sum = 0;
+  for (int i = 0; i < frames; ++i) {
+    const ProfileFrame &frame = ProfileRecentFrame(i);
+    sum += phase == PROFILE_NO_PHASE ? frame.total_ns : frame.phase_ns[phase];
+  }
+  return sum / 1e6 / frames;
+}
+
+}
+
+#endif //BUNKERBUILDER_PROFILER_H
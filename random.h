@@ -1,24 +1,124 @@
 #ifndef BUNKERBUILDER_RANDOM_H
 #define BUNKERBUILDER_RANDOM_H
 #include <stdint.h>
+#include <stddef.h>
 namespace bb {
     namespace random {
-        uint32_t x = 0x9d546264u, y = 0x13664b81u, z = 0x1be129e9u, w = 0x1686d9f3u;
+        inline uint32_t rotl(uint32_t x, int k) {
+            return (x << k) | (x >> (32 - k));
+        }
+
+        /**
+         * Seedable xoshiro128** generator.
+         *
+         * Independent streams are made with Split(), which hands out the current stream and
+         * jumps this generator 2^64 steps ahead. Everything derived from one seed by splitting
+         * is reproducible no matter in which order or on which thread the streams are used.
+         */
+        struct Rng {
+            uint32_t s[4];
+
+            explicit Rng(uint64_t seed = 0x9d54626413664b81ull) {
+                Seed(seed);
+            }
+
+            void Seed(uint64_t seed) {
+                // splitmix64 spreads the seed over the whole state (which must not be all zero)
+                for (int i = 0; i < 4; i += 2) {
+                    uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+                    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                    z ^= z >> 31;
+                    s[i] = (uint32_t) z;
+                    s[i + 1] = (uint32_t) (z >> 32);
+                }
+            }
+
+            uint32_t u32() {
+                const uint32_t result = rotl(s[1] * 5, 7) * 9;
+                const uint32_t t = s[1] << 9;
+                s[2] ^= s[0];
+                s[3] ^= s[1];
+                s[1] ^= s[2];
+                s[0] ^= s[3];
+                s[2] ^= t;
+                s[3] = rotl(s[3], 11);
+                return result;
+            }
+
+            int32_t i32() {
+                return (int32_t) u32();
+            }
+
+            // Uniform in [0, n) (Lemire's multiply-shift, slightly biased for huge n).
+            uint32_t Below(uint32_t n) {
+                return (uint32_t) (((uint64_t) u32() * n) >> 32);
+            }
+
+            // Equivalent to 2^64 calls to u32().
+            void Jump() {
+                static const uint32_t JUMP[] = {0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b};
+                uint32_t t[4] = {0, 0, 0, 0};
+                for (uint32_t word : JUMP) {
+                    for (int b = 0; b < 32; ++b) {
+                        if (word & (1u << b)) {
+                            for (int i = 0; i < 4; ++i) t[i] ^= s[i];
+                        }
+                        u32();
+                    }
+                }
+                for (int i = 0; i < 4; ++i) s[i] = t[i];
+            }
+
+            Rng Split() {
+                Rng stream = *this;
+                Jump();
+                return stream;
+            }
+
+            static const int LANES = 8;
+
+            /**
+             * Fills `out` with `n` random numbers. The numbers come from LANES streams split off
+             * this generator and advanced in lockstep, so the loop over lanes vectorizes. The
+             * output differs from calling u32() n times but is just as reproducible.
+             */
+            void Fill(uint32_t *out, size_t n) {
+                uint32_t s0[LANES], s1[LANES], s2[LANES], s3[LANES];
+                for (int l = 0; l < LANES; ++l) {
+                    Rng lane = Split();
+                    s0[l] = lane.s[0];
+                    s1[l] = lane.s[1];
+                    s2[l] = lane.s[2];
+                    s3[l] = lane.s[3];
+                }
+                uint32_t block[LANES];
+                for (size_t i = 0; i < n; i += LANES) {
+                    for (int l = 0; l < LANES; ++l) {
+                        block[l] = rotl(s1[l] * 5, 7) * 9;
+                        const uint32_t t = s1[l] << 9;
+                        s2[l] ^= s0[l];
+                        s3[l] ^= s1[l];
+                        s1[l] ^= s2[l];
+                        s0[l] ^= s3[l];
+                        s2[l] ^= t;
+                        s3[l] = rotl(s3[l], 11);
+                    }
+                    size_t count = n - i < LANES ? n - i : LANES;
+                    for (size_t l = 0; l < count; ++l) out[i + l] = block[l];
+                }
+            }
+        };
+
+        // Stream for code that isn't tied to a world.
+        Rng global;
 
         uint32_t u32(void) {
-            uint32_t t = x;
-            t ^= t << 11;
-            t ^= t >> 8;
-            x = y;
-            y = z;
-            z = w;
-            w ^= w >> 19;
-            w ^= t;
-            return w;
+            return global.u32();
         }
 
         int32_t i32(void) {
-            return (int32_t) u32();
+            return global.i32();
         }
     }
 }
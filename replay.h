@@ -0,0 +1,236 @@
+#ifndef BUNKERBUILDER_REPLAY_H
+#define BUNKERBUILDER_REPLAY_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "game.h"
+#include "snapshot.h"
+#include "worldgen.h"
+
+/**
+ * Deterministic recording & replay.
+ *
+ * Everything that changes the world from the outside (input, scene setup) goes through
+ * ExecuteCommand(). While recording, each command is logged together with the tick number
+ * at which it was applied. Seeding, loading and generating the world during setup (e.g. by
+ * a scenario) are logged through RecordSeed(), RecordLoad() and RecordGenerate(), and a
+ * replay applies them in the order they were logged. The log also holds the world's random
+ * generator state from the start of the recording and a checksum of the world at its end,
+ * so a replay can tell whether it arrived at the identical state.
+ *
+ * Log format - one record per line:
+ *   bbreplay 1
+ *   load <snapshot path>              (optional - recording started from a snapshot)
+ *   seed <x> <y> <z> <w>
+ *   gen <generator spec>               (optional - world built by GenerateWorld)
+ *   cmd <tick> <type> <a> <b> <kind> <c> <d>    (older logs have no <c> <d>)
+ *   (more load / seed / gen records may follow the first commands)
+ *   end <tick> <checksum>
+ */
+
+namespace bb {
+
+using namespace std;
+
+enum WorldCommandType {
+  WORLD_TOGGLE_PLAN = 0,
+  WORLD_ADD_STRUCTURE,
+  WORLD_ADD_ITEM,
+  WORLD_ADD_DWARF,
+  WORLD_FILL_PLANS,
+  WORLD_COMMAND_TYPE_COUNT
+};
+
+struct WorldCommand {
+  WorldCommandType type;
+  int a, b; // row & column or y & x
+  int kind; // StructureType or ItemType
+  int c = 0, d = 0; // second corner of an area
+
+  static WorldCommand TogglePlan(Cell cell, StructureType structure_type) {
+    return WorldCommand{WORLD_TOGGLE_PLAN, cell.row, cell.col, structure_type};
+  }
+
+  static WorldCommand AddStructure(int row, int col, StructureType structure_type) {
+    return WorldCommand{WORLD_ADD_STRUCTURE, row, col, structure_type};
+  }
+
+  static WorldCommand AddItem(Point pos, ItemType item_type) {
+    return WorldCommand{WORLD_ADD_ITEM, pos.y, pos.x, item_type};
+  }
+
+  static WorldCommand AddDwarf(int row, int col) {
+    return WorldCommand{WORLD_ADD_DWARF, row, col, 0};
+  }
+
+  // NONE removes the plans.
+  static WorldCommand FillPlans(Cell from, Cell to, StructureType structure_type) {
+    return WorldCommand{WORLD_FILL_PLANS, from.row, from.col, structure_type, to.row, to.col};
+  }
+};
+
+void ApplyCommand(World &w, const WorldCommand &command) {
+  switch (command.type) {
+    case WORLD_TOGGLE_PLAN:
+      TogglePlan(w, Cell(command.a, command.b), (StructureType) command.kind);
+      break;
+    case WORLD_ADD_STRUCTURE:
+      if (Structure *structure = Structure::New((StructureType) command.kind))
+        AddStructure(w, command.a, command.b, structure);
+      break;
+    case WORLD_ADD_ITEM:
+      if (command.kind >= 0 && command.kind < NO_ITEM_TYPE)
+        AddItem(w, Point(command.a, command.b), (ItemType) command.kind);
+      break;
+    case WORLD_ADD_DWARF:
+      AddDwarf(w, Dwarf::MakeRandom(w, command.a, command.b));
+      break;
+    case WORLD_FILL_PLANS:
+      if (command.kind >= NONE && command.kind <= MUSHROOM_FARM)
+        FillPlans(w, Cell(command.a, command.b), Cell(command.c, command.d), (StructureType) command.kind);
+      break;
+    default:
+      fprintf(stderr, "Unknown world command: %d\n", command.type);
+      break;
+  }
+  w.events.Dispatch(w);
+}
+
+FILE *recording = nullptr;
+
+uint64_t WorldChecksum(const World &w) {
+  vector<char> data = SerializeWorld(w);
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  for (char c : data) {
+    hash ^= (uint8_t) c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool StartRecording(const World &w, const string &path, const string &loaded_snapshot = "",
+                    const string &generator_spec = "") {
+  recording = fopen(path.c_str(), "w");
+  if (recording == nullptr) {
+    fprintf(stderr, "Failed to open recording %s\n", path.c_str());
+    return false;
+  }
+  fprintf(recording, "bbreplay 1\n");
+  if (!loaded_snapshot.empty()) fprintf(recording, "load %s\n", loaded_snapshot.c_str());
+  fprintf(recording, "seed %u %u %u %u\n", w.rng.s[0], w.rng.s[1], w.rng.s[2], w.rng.s[3]);
+  if (!generator_spec.empty()) fprintf(recording, "gen %s\n", generator_spec.c_str());
+  return true;
+}
+
+void RecordSeed(const World &w) {
+  if (recording) fprintf(recording, "seed %u %u %u %u\n", w.rng.s[0], w.rng.s[1], w.rng.s[2], w.rng.s[3]);
+}
+
+void RecordLoad(const string &path) {
+  if (recording) fprintf(recording, "load %s\n", path.c_str());
+}
+
+void RecordGenerate(const string &generator_spec) {
+  if (recording) fprintf(recording, "gen %s\n", generator_spec.c_str());
+}
+
+void StopRecording(const World &w) {
+  if (recording == nullptr) return;
+  fprintf(recording, "end %lld %llu\n", (long long) w.tick_number, (unsigned long long) WorldChecksum(w));
+  fclose(recording);
+  recording = nullptr;
+}
+
+void ExecuteCommand(World &w, const WorldCommand &command) {
+  if (recording) {
+    fprintf(recording, "cmd %lld %d %d %d %d %d %d\n", (long long) w.tick_number, command.type, command.a, command.b,
+            command.kind, command.c, command.d);
+  }
+  ApplyCommand(w, command);
+}
+
+// Re-runs a recording without any input or rendering. Returns true if the final state
+// matches the recorded one.
+bool RunReplay(World &w, const string &path) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open recording %s\n", path.c_str());
+    return false;
+  }
+  char line[1024];
+  if (!fgets(line, sizeof(line), f) || string(line) != "bbreplay 1\n") {
+    fprintf(stderr, "%s is not a recording\n", path.c_str());
+    fclose(f);
+    return false;
+  }
+  vector<pair<int64_t, WorldCommand>> commands;
+  long long end_tick = -1;
+  unsigned long long end_checksum = 0;
+  // Commands logged before a seed, load or gen record were applied before it, all in the
+  // same tick.
+  size_t applied = 0;
+  auto apply_logged = [&]() {
+    for (; applied < commands.size(); ++applied) ApplyCommand(w, commands[applied].second);
+  };
+  while (fgets(line, sizeof(line), f)) {
+    long long tick;
+    int type, a, b, kind, c = 0, d = 0;
+    char load_path[1000], spec[1000];
+    uint32_t s[4];
+    if (sscanf(line, "seed %u %u %u %u", &s[0], &s[1], &s[2], &s[3]) == 4) {
+      apply_logged();
+      memcpy(w.rng.s, s, sizeof(w.rng.s));
+    } else if (sscanf(line, "load %999[^\n]", load_path) == 1) {
+      apply_logged();
+      if (!LoadSnapshot(w, load_path)) {
+        fclose(f);
+        return false;
+      }
+    } else if (sscanf(line, "gen %999[^\n]", spec) == 1) {
+      apply_logged();
+      WorldGenParams params;
+      if (!ParseWorldGenParams(spec, params)) {
+        fclose(f);
+        return false;
+      }
+      GenerateWorld(w, params);
+    } else if (sscanf(line, "cmd %lld %d %d %d %d %d %d", &tick, &type, &a, &b, &kind, &c, &d) >= 5) {
+      commands.push_back(make_pair((int64_t) tick, WorldCommand{(WorldCommandType) type, a, b, kind, c, d}));
+    } else if (sscanf(line, "end %lld %llu", &end_tick, &end_checksum) == 2) {
+    } else {
+      fprintf(stderr, "Malformed recording line: %s", line);
+    }
+  }
+  fclose(f);
+  if (end_tick < 0) {
+    fprintf(stderr, "Recording %s has no end - was the game closed cleanly?\n", path.c_str());
+    end_tick = commands.empty() ? w.tick_number : commands.back().first;
+  }
+
+  auto start = chrono::steady_clock::now();
+  int64_t ticks = 0;
+  size_t next = applied;
+  while (true) {
+    while (next < commands.size() && commands[next].first <= w.tick_number) {
+      ApplyCommand(w, commands[next++].second);
+    }
+    if (w.tick_number >= end_tick) break;
+    Tick(w);
+    ++ticks;
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  uint64_t checksum = WorldChecksum(w);
+  bool match = checksum == end_checksum;
+  printf("Replayed %lld ticks in %.3f s (%.0f ticks/s), state hash %016llx, checksum %016llx: %s\n",
+         (long long) ticks, seconds, seconds > 0 ? ticks / seconds : 0., (unsigned long long) WorldHash(w),
+         (unsigned long long) checksum, match ? "match" : "MISMATCH");
+  return match;
+}
+
+}
+
+#endif //BUNKERBUILDER_REPLAY_H
@@ -0,0 +1,112 @@
+#ifndef BUNKERBUILDER_SCENARIO_H
+#define BUNKERBUILDER_SCENARIO_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "game.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "worldgen.h"
+
+/**
+ * Scenario files - hand-written starting worlds for headless runs.
+ *
+ * One directive per line, '#' starts a comment:
+ *   seed <n>                     seeds the world's random generator
+ *   load <snapshot path>         starts from a snapshot
+ *   generate <generator spec>    starts from a generated bunker (see worldgen.h)
+ *   structure <row> <col> <staircase|corridor|mushroom_farm>
+ *   plan <row> <col> <staircase|corridor|mushroom_farm>
+ *   item <y> <x> spore
+ *   dwarf <row> <col>
+ *   ticks <n>                    default tick limit of the run
+ *
+ * Objects are added through ExecuteCommand(), and seed, load and generate are logged, so
+ * recordings started before the scenario replay it.
+ */
+
+namespace bb {
+
+using namespace std;
+
+// The small demo bunker the game starts with.
+void BuildScene(World &w) {
+  ExecuteCommand(w, WorldCommand::AddDwarf(0, 2));
+//  ExecuteCommand(w, WorldCommand::AddDwarf(2, 5));
+  ExecuteCommand(w, WorldCommand::AddStructure(1, 5, STAIRCASE));
+  ExecuteCommand(w, WorldCommand::AddStructure(2, 5, STAIRCASE));
+  ExecuteCommand(w, WorldCommand::AddStructure(3, 5, STAIRCASE));
+  ExecuteCommand(w, WorldCommand::AddStructure(3, 4, CORRIDOR));
+  ExecuteCommand(w, WorldCommand::AddStructure(3, 3, CORRIDOR));
+  ExecuteCommand(w, WorldCommand::AddStructure(3, 2, MUSHROOM_FARM));
+  ExecuteCommand(w, WorldCommand::AddItem(Point(100, 800), SPORE));
+}
+
+struct ScenarioSettings {
+  int64_t ticks = -1; // -1 if the scenario doesn't say
+};
+
+bool ParseStructureType(const char *name, StructureType &type) {
+  if (strcmp(name, "staircase") == 0) type = STAIRCASE;
+  else if (strcmp(name, "corridor") == 0) type = CORRIDOR;
+  else if (strcmp(name, "mushroom_farm") == 0) type = MUSHROOM_FARM;
+  else return false;
+  return true;
+}
+
+bool LoadScenario(World &w, const string &path, ScenarioSettings &settings) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open scenario %s\n", path.c_str());
+    return false;
+  }
+  char line[1024];
+  int line_number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f)) {
+    ++line_number;
+    if (char *comment = strchr(line, '#')) *comment = 0;
+    char directive[32], arg[1000], name[32];
+    unsigned long long seed;
+    long long ticks;
+    int a, b;
+    StructureType type;
+    if (sscanf(line, "%31s", directive) != 1) {
+      continue; // blank line
+    } else if (sscanf(line, "seed %llu", &seed) == 1) {
+      w.rng.Seed(seed);
+      RecordSeed(w);
+    } else if (sscanf(line, "load %999[^\n]", arg) == 1) {
+      ok = LoadSnapshot(w, arg);
+      if (ok) RecordLoad(arg);
+    } else if (sscanf(line, "generate %999s", arg) == 1) {
+      WorldGenParams params;
+      ok = ParseWorldGenParams(arg, params);
+      if (ok) {
+        RecordGenerate(FormatWorldGenParams(params));
+        GenerateWorld(w, params);
+      }
+    } else if (sscanf(line, "structure %d %d %31s", &a, &b, name) == 3 && ParseStructureType(name, type)) {
+      ExecuteCommand(w, WorldCommand::AddStructure(a, b, type));
+    } else if (sscanf(line, "plan %d %d %31s", &a, &b, name) == 3 && ParseStructureType(name, type)) {
+      if (!HasPlan(w, Cell(a, b))) ExecuteCommand(w, WorldCommand::TogglePlan(Cell(a, b), type));
+    } else if (sscanf(line, "item %d %d %31s", &a, &b, name) == 3 && strcmp(name, "spore") == 0) {
+      ExecuteCommand(w, WorldCommand::AddItem(Point(a, b), SPORE));
+    } else if (sscanf(line, "dwarf %d %d", &a, &b) == 2) {
+      ExecuteCommand(w, WorldCommand::AddDwarf(a, b));
+    } else if (sscanf(line, "ticks %lld", &ticks) == 1) {
+      settings.ticks = ticks;
+    } else {
+      fprintf(stderr, "%s:%d: can't understand '%s'\n", path.c_str(), line_number, directive);
+      ok = false;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+}
+
+#endif //BUNKERBUILDER_SCENARIO_H
@@ -8,7 +8,14 @@
 #include <SDL2/SDL_image.h>
 #include <SDL_ttf.h>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include "assets.h"
 #include "game.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "pipeline.h"
+#include "lod.h"
 #include "utils.h"
 
 namespace bb {
@@ -47,8 +54,26 @@ int middle_down_x, middle_down_y;
 double last_scale = .5;
 int middle_down_time;
 
-StructureType fill_structure;
-set<Cell> toggled_cells;
+// Dragging with the left button plans (or clears) the whole rectangle on release.
+StructureType fill_structure = NONE;
+Cell fill_start, fill_end;
+bool fill_clears;
+
+// Zoom levels below which Draw() switches to cheaper representations.
+double lod_tile_scale = 0.25;  // chunks drawn in the average color of their cells
+double lod_dwarf_scale = 0.25; // one dot per chunk with dwarves in it
+double lod_label_scale = 0.4;  // no names or speech
+
+bool show_profiler = false;
+
+// Set by anything that changes what's on screen. Draw() is skipped while it's false.
+bool redraw_needed = true;
+Uint32 wake_event_type;
+Cell marker_cell; // where the selection marker was drawn
+uint64_t drawn_hash = 0;
+int drawn_money = 0;
+int64_t drawn_cells_version = -1;
+string quicksave_path = "quicksave.bbs";
 
 void SetScale(double new_scale) {
   int mx, my;
@@ -58,12 +83,20 @@ void SetScale(double new_scale) {
   scale = clamp(new_scale, 0.1, 10.);
   camera.y = cy - int(my / scale);
   camera.x = cx - int(mx / scale);
+  redraw_needed = true;
 }
 
-SDL_Texture *LoadTexture(const string &filename) {
-  SDL_Surface *surface = IMG_Load(filename.c_str());
+// Estimated GPU memory of a texture, for memory.h.
+int64_t TextureBytes(SDL_Texture *texture) {
+  Uint32 format = 0;
+  int w = 0, h = 0;
+  if (texture == nullptr || SDL_QueryTexture(texture, &format, nullptr, &w, &h) != 0) return 0;
+  return int64_t(w) * h * SDL_BYTESPERPIXEL(format);
+}
+
+SDL_Texture *LoadTexture(const string &filename, SDL_Surface *surface) {
   if (surface == nullptr) {
-    fprintf(stderr, "Failure while loading texture surface : %s\n",
+    fprintf(stderr, "Failure while loading texture surface %s : %s\n", filename.c_str(),
             SDL_GetError());
     return nullptr;
   }
@@ -73,10 +106,11 @@ SDL_Texture *LoadTexture(const string &filename) {
     return nullptr;
   }
   SDL_FreeSurface(surface);
+  MemoryAlloc(MEMORY_TEXTURES, TextureBytes(texture));
   return texture;
 }
 
-void GetEffectiveSDL_Rect(const Dwarf &d, SDL_Rect *rect) {
+void GetEffectiveSDL_Rect(const RenderDwarf &d, SDL_Rect *rect) {
   int w = 82;
   int h = 100;
   rect->x = (int) ((d.pos.x - w / 2 - camera.x) * scale);
@@ -91,26 +125,52 @@ void GetMouseCell(Cell *out) {
   *out = Cell(Point(camera.y + my / scale, camera.x + mx / scale));
 }
 
-void TogglePlan(const Cell &c, StructureType structure_type) {
-  auto it = plans.find(c);
-  if (it != plans.end()) {
-    bool the_same = it->second->structure_type == structure_type;
-    delete it->second;
-    plans.erase(it);
-    if (the_same) return;
+// Uploads the images found in the asset bundle as they are. The rest are decoded from their
+// files on worker threads - only creating the textures has to happen on this thread.
+void LoadTextures(const vector<string> &names, unordered_map<string, SDL_Texture *> &out) {
+  vector<string> missing;
+  for (const string &name : names) {
+    const BundleEntry *entry = asset_bundle.Find(name);
+    if (entry == nullptr || entry->width == 0) {
+      missing.push_back(name);
+      continue;
+    }
+    SDL_Texture *texture =
+        SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, entry->width, entry->height);
+    if (texture == nullptr) {
+      fprintf(stderr, "Failure while loading texture %s : %s\n", name.c_str(), SDL_GetError());
+      continue;
+    }
+    SDL_UpdateTexture(texture, nullptr, asset_bundle.Data(*entry), int(entry->width * 4));
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    MemoryAlloc(MEMORY_TEXTURES, TextureBytes(texture));
+    out[name] = texture;
   }
-  plans[c] = new Plan(structure_type);
+
+  vector<SDL_Surface *> surfaces(missing.size());
+  atomic<size_t> next{0};
+  vector<thread> workers;
+  size_t worker_count = min<size_t>(missing.size(), max(1u, thread::hardware_concurrency()));
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers.emplace_back([&] {
+      for (size_t j; (j = next++) < missing.size();) surfaces[j] = IMG_Load(missing[j].c_str());
+    });
+  }
+  for (thread &t : workers) t.join();
+  for (size_t i = 0; i < missing.size(); ++i) out[missing[i]] = LoadTexture(missing[i], surfaces[i]);
 }
 
 bool InitTextures() {
-  sky = LoadTexture("sky.png");
-  dwarf = LoadTexture("dwarf.gif");
-  textures[NONE] = LoadTexture("ground.png");
-  textures[STAIRCASE] = LoadTexture("staircase.png");
-  textures[CORRIDOR] = LoadTexture("corridor.png");
-  textures[MUSHROOM_FARM] = LoadTexture("mushroom_farm.png");
+  unordered_map<string, SDL_Texture *> loaded;
+  LoadTextures(ImageAssets(), loaded);
+  sky = loaded["sky.png"];
+  dwarf = loaded["dwarf.gif"];
+  textures[NONE] = loaded["ground.png"];
+  textures[STAIRCASE] = loaded["staircase.png"];
+  textures[CORRIDOR] = loaded["corridor.png"];
+  textures[MUSHROOM_FARM] = loaded["mushroom_farm.png"];
 
-  selection_texture = LoadTexture("block_selection.png");
+  selection_texture = loaded["block_selection.png"];
 
   buttons.clear();
   for (auto p : initializer_list<pair<string, Command >> {
@@ -123,7 +183,7 @@ bool InitTextures() {
   }
       ) {
     Button *b = new Button();
-    b->texture = LoadTexture(p.first);
+    b->texture = loaded[p.first];
     Command c = p.second;
     b->action = [c](Button *self) {
       if (active_button == self) {
@@ -138,11 +198,15 @@ bool InitTextures() {
   }
 
   for (int i = 0; i < NO_ITEM_TYPE; ++i) {
-    item_textures[i] = LoadTexture(item_defs[i].texture_name);
+    item_textures[i] = loaded[item_defs[i].texture_name];
   }
 
   TTF_Init();
-  font = TTF_OpenFont("./Katibeh-Regular.ttf", 24);
+  // The font is read lazily, so the bundle stays mapped for as long as the game runs.
+  if (const BundleEntry *entry = asset_bundle.Find(font_asset))
+    font = TTF_OpenFontRW(SDL_RWFromConstMem(asset_bundle.Data(*entry), int(entry->size)), 1, 24);
+  else
+    font = TTF_OpenFont((string("./") + font_asset).c_str(), 24);
   if (!font) {
     fprintf(stderr, "TTF_OpenFont: %s\n", TTF_GetError());
     return false;
@@ -160,18 +224,37 @@ bool InitRenderer() {
   SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
   SDL_GetRendererOutputSize(renderer, &windowRect.w, &windowRect.h);
   SDL_SetRenderDrawColor(renderer, 64, 0, 0, 255);
+  // Show the window while the textures load.
+  SDL_RenderClear(renderer);
+  SDL_RenderPresent(renderer);
   return InitTextures();
 }
 
-bool HandleInput() {
+// Waits up to `wait_ms` for the first event when there's nothing to draw.
+bool HandleInput(int wait_ms = 0) {
   SDL_Event event;
-  while (SDL_PollEvent(&event)) {
+  bool have_event = (wait_ms > 0 ? SDL_WaitEventTimeout(&event, wait_ms) : SDL_PollEvent(&event)) != 0;
+  ScopedTimer timer(PROFILE_INPUT);
+  for (; have_event; have_event = SDL_PollEvent(&event) != 0) {
+    if (event.type == wake_event_type)
+      continue; // UpdateRenderState() will look at the new frame
+    if (event.type != SDL_MOUSEMOTION)
+      redraw_needed = true;
     if (event.type == SDL_QUIT)
       return false;
     else if (event.type == SDL_KEYDOWN) {
       switch (event.key.keysym.sym) {
         case SDLK_ESCAPE:
           return false;
+        case SDLK_F3:
+          show_profiler = !show_profiler;
+          break;
+        case SDLK_F4:
+          if (trace_enabled) WriteTrace(trace_path);
+          break;
+        case SDLK_F5:
+          snapshot_requests.Push(quicksave_path);
+          break;
         default:
           windowRect.w += 100;
           //InitRenderer();
@@ -206,8 +289,11 @@ bool HandleInput() {
             default:
               break;
           }
-          toggled_cells.insert(c);
-          TogglePlan(c, fill_structure);
+          // Starting on a plan of the same kind clears the area instead.
+          const RenderFrame &frame = render_frames.Front();
+          auto it = frame.plans.find(c);
+          fill_clears = it != frame.plans.end() && it->second.structure_type == fill_structure;
+          fill_start = fill_end = c;
         }
       }
     } else if (event.type == SDL_MOUSEBUTTONUP) {
@@ -222,23 +308,25 @@ bool HandleInput() {
             SetScale(1);
           }
         }
-      } else if (event.button.button == SDL_BUTTON_LEFT) {
+      } else if (event.button.button == SDL_BUTTON_LEFT && fill_structure != NONE) {
+        if (fill_start == fill_end)
+          QueueWorldCommand(WorldCommand::TogglePlan(fill_start, fill_structure));
+        else
+          QueueWorldCommand(WorldCommand::FillPlans(fill_start, fill_end, fill_clears ? NONE : fill_structure));
         fill_structure = NONE;
-        toggled_cells.clear();
       }
     } else if (event.type == SDL_MOUSEMOTION) {
       if (middle_down) {
         camera.y = middle_down_y - int(event.motion.y / scale);
         camera.x = middle_down_x - int(event.motion.x / scale);
+        redraw_needed = true;
       }
-      if (fill_structure != NONE) {
+      if (active_command != COMMAND_SELECT) {
         Cell c;
         GetMouseCell(&c);
-        if (toggled_cells.find(c) == toggled_cells.end()) {
-          toggled_cells.insert(c);
-          TogglePlan(c, fill_structure);
-        }
+        if (c != marker_cell) redraw_needed = true;
       }
+      if (fill_structure != NONE) GetMouseCell(&fill_end);
     } else if (event.type == SDL_MOUSEWHEEL) {
       SetScale(scale * exp2(event.wheel.y / 4.));
     } else if (event.type == SDL_WINDOWEVENT) {
@@ -261,12 +349,12 @@ SDL_Texture *GetTextureForStructureType(StructureType structure_type) {
   return textures[structure_type];
 }
 
-SDL_Texture *GetTextureForCell(const Cell &cell) {
-  auto it = cells.find(cell);
-  if (it == cells.end()) {
+SDL_Texture *GetTextureForCell(const RenderFrame &frame, const Cell &cell) {
+  auto it = frame.cells.find(cell);
+  if (it == frame.cells.end()) {
     return cell.row <= 0 ? sky : textures[NONE];
   }
-  return GetTextureForStructureType(it->second->type);
+  return GetTextureForStructureType(it->second);
 }
 
 void GetTileRect(int row, int col, SDL_Rect *out) {
@@ -276,6 +364,132 @@ void GetTileRect(int row, int col, SDL_Rect *out) {
   out->h = int(((row + 1) * H - camera.y) * scale) - out->y;
 }
 
+void GetAreaRect(const Cell &first, const Cell &last, SDL_Rect *out) {
+  out->x = int((first.col * W - camera.x) * scale);
+  out->y = int((first.row * H - camera.y) * scale);
+  out->w = int(((last.col + 1) * W - camera.x) * scale) - out->x;
+  out->h = int(((last.row + 1) * H - camera.y) * scale) - out->y;
+}
+
+void DrawChunkSummaries(const RenderFrame &frame, const Cell &top_left, const Cell &bottom_right) {
+  Cell first = ChunkOf(top_left), last = ChunkOf(bottom_right);
+  SDL_Rect rect;
+  for (int row = first.row; row <= last.row; ++row) {
+    for (int col = first.col; col <= last.col; ++col) {
+      Cell chunk(row, col);
+      auto it = frame.chunks.find(chunk);
+      Rgb color = ChunkColor(chunk, it == frame.chunks.end() ? nullptr : &it->second);
+      GetAreaRect(Cell(row * CHUNK_SIZE, col * CHUNK_SIZE),
+                  Cell(row * CHUNK_SIZE + CHUNK_SIZE - 1, col * CHUNK_SIZE + CHUNK_SIZE - 1), &rect);
+      SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, 255);
+      SDL_RenderFillRect(renderer, &rect);
+    }
+  }
+  SDL_SetRenderDrawColor(renderer, 64, 0, 0, 255);
+}
+
+void DrawDwarfDots(const RenderFrame &frame) {
+  static unordered_map<Cell, int> counts;
+  counts.clear();
+  for (const RenderDwarf &d : frame.dwarves) ++counts[ChunkOf(Cell(d.pos))];
+  SDL_SetRenderDrawColor(renderer, 255, 230, 80, 255);
+  for (auto &p : counts) {
+    SDL_Rect chunk_rect;
+    GetAreaRect(Cell(p.first.row * CHUNK_SIZE, p.first.col * CHUNK_SIZE),
+                Cell(p.first.row * CHUNK_SIZE + CHUNK_SIZE - 1, p.first.col * CHUNK_SIZE + CHUNK_SIZE - 1),
+                &chunk_rect);
+    int size = min(chunk_rect.w, 4 + int(2 * sqrt(p.second)));
+    SDL_Rect dot = {chunk_rect.x + (chunk_rect.w - size) / 2, chunk_rect.y + (chunk_rect.h - size) / 2, size, size};
+    SDL_RenderFillRect(renderer, &dot);
+  }
+  SDL_SetRenderDrawColor(renderer, 64, 0, 0, 255);
+}
+
+/**
+ * Minimap - one pixel per chunk, rebuilt from the chunk summaries at most twice per second
+ * and only if the structures changed.
+ */
+SDL_Texture *minimap = nullptr;
+int64_t minimap_version = -1;
+int minimap_time = -1000000;
+Cell minimap_first, minimap_last; // chunks covered by the texture
+
+// Whether UpdateMinimap() would rebuild the texture now.
+bool MinimapDue(const RenderFrame &frame, int now) {
+  return frame.cells_version != minimap_version && now - minimap_time >= 500;
+}
+
+void UpdateMinimap(const RenderFrame &frame) {
+  int now = SDL_GetTicks();
+  if (!MinimapDue(frame, now)) return;
+  minimap_version = frame.cells_version;
+  minimap_time = now;
+  Cell first = ChunkOf(Cell(-1, 0)), last = first;
+  for (auto &p : frame.chunks) {
+    if (p.second.Total() == 0) continue;
+    first = Cell(min(first.row, p.first.row), min(first.col, p.first.col));
+    last = Cell(max(last.row, p.first.row), max(last.col, p.first.col));
+  }
+  const int max_size = 4096;
+  last = Cell(min(last.row, first.row + max_size - 1), min(last.col, first.col + max_size - 1));
+  int w = last.col - first.col + 1, h = last.row - first.row + 1;
+  if (minimap == nullptr || w != minimap_last.col - minimap_first.col + 1 ||
+      h != minimap_last.row - minimap_first.row + 1) {
+    if (minimap) {
+      MemoryFree(MEMORY_TEXTURES, TextureBytes(minimap));
+      SDL_DestroyTexture(minimap);
+    }
+    minimap = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, w, h);
+    MemoryAlloc(MEMORY_TEXTURES, TextureBytes(minimap));
+  }
+  minimap_first = first;
+  minimap_last = last;
+  static vector<uint8_t> pixels;
+  pixels.resize(size_t(w) * h * 4);
+  uint8_t *pixel = pixels.data();
+  for (int row = first.row; row <= last.row; ++row) {
+    for (int col = first.col; col <= last.col; ++col, pixel += 4) {
+      Cell chunk(row, col);
+      auto it = frame.chunks.find(chunk);
+      Rgb color = ChunkColor(chunk, it == frame.chunks.end() ? nullptr : &it->second);
+      pixel[0] = color.r;
+      pixel[1] = color.g;
+      pixel[2] = color.b;
+      pixel[3] = 255;
+    }
+  }
+  if (minimap) SDL_UpdateTexture(minimap, nullptr, pixels.data(), w * 4);
+}
+
+void DrawMinimap(const RenderFrame &frame) {
+  UpdateMinimap(frame);
+  if (minimap == nullptr) return;
+  const int max_w = 200, max_h = 200, margin = 10;
+  int w = minimap_last.col - minimap_first.col + 1, h = minimap_last.row - minimap_first.row + 1;
+  // Chunks are twice as tall as wide on screen.
+  double px = min(double(max_w) / w, double(max_h) / (2 * h));
+  SDL_Rect dest = {0, 0, max(1, int(w * px)), max(1, int(2 * h * px))};
+  dest.x = windowRect.w - dest.w - margin;
+  dest.y = windowRect.h - dest.h - margin;
+  SDL_RenderCopy(renderer, minimap, nullptr, &dest);
+
+  auto to_minimap_x = [&](double x) { return dest.x + int((x / (W * CHUNK_SIZE) - minimap_first.col) * px); };
+  auto to_minimap_y = [&](double y) { return dest.y + int((y / (H * CHUNK_SIZE) - minimap_first.row) * 2 * px); };
+  vector<SDL_Rect> dots;
+  for (const RenderDwarf &d : frame.dwarves) dots.push_back(SDL_Rect{to_minimap_x(d.pos.x) - 1, to_minimap_y(d.pos.y) - 1, 2, 2});
+  SDL_SetRenderDrawColor(renderer, 255, 230, 80, 255);
+  SDL_RenderFillRects(renderer, dots.data(), (int) dots.size());
+  SDL_Rect view;
+  view.x = to_minimap_x(camera.x);
+  view.y = to_minimap_y(camera.y);
+  view.w = max(2, to_minimap_x(camera.x + windowRect.w / scale) - view.x);
+  view.h = max(2, to_minimap_y(camera.y + windowRect.h / scale) - view.y);
+  SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+  SDL_RenderDrawRect(renderer, &view);
+  SDL_RenderDrawRect(renderer, &dest);
+  SDL_SetRenderDrawColor(renderer, 64, 0, 0, 255);
+}
+
 struct Text {
   SDL_Texture *texture;
   SDL_Rect size;
@@ -297,28 +511,142 @@ struct Text {
     SDL_Surface *surface = surface_outer;
     texture = SDL_CreateTextureFromSurface(renderer, surface);
     SDL_FreeSurface(surface);
+    MemoryAlloc(MEMORY_TEXT_TEXTURES, TextureBytes(texture));
   }
 
-  virtual ~Text() { SDL_DestroyTexture(texture); }
+  virtual ~Text() {
+    MemoryFree(MEMORY_TEXT_TEXTURES, TextureBytes(texture));
+    SDL_DestroyTexture(texture);
+  }
 };
 
-struct SaidText : Text {
-  int time_said;
+// Keyed by dwarf id. Names are rendered when a dwarf first shows up in a RenderFrame.
+map<int, deque<Text *>> said_texts;
+map<int, Text *> name_texts;
 
-  SaidText(const string &s, const SDL_Color &fg, const SDL_Color &bg) : Text(s, fg, bg),
-                                                                        time_said(SDL_GetTicks()) { }
-};
+Text* GetMoneyText(const RenderFrame &frame) {
+  static int last_money = frame.money;
+  static Text* money_text = new Text('$' + FormatWithCommas(frame.money), {128,255,128,0}, {64, 128, 64, 0});
+  return money_text;
+}
 
-map<Dwarf *, deque<SaidText *>> said_texts;
-map<Dwarf *, Text *> name_texts;
+vector<Text *> profiler_texts;
+int profiler_texts_time = -1000000;
+int64_t profiler_memory_allocated[MEMORY_TAG_COUNT]; // at the last update, for the rates
 
-Text* GetMoneyText() {
-  static int last_money = money;
-  static Text* money_text = new Text('$' + FormatWithCommas(money), {128,255,128,0}, {64, 128, 64, 0});
-  return money_text;
+string FormatBytes(double bytes) {
+  if (bytes < 1024) return format("%.0f B", bytes);
+  if (bytes < 1024 * 1024) return format("%.1f KB", bytes / 1024);
+  return format("%.1f MB", bytes / (1024 * 1024));
+}
+
+// Rebuilds the overlay labels twice per second - rendering text every frame would cost more
+// than most of the phases being measured.
+void UpdateProfilerTexts() {
+  int now = SDL_GetTicks();
+  if (now - profiler_texts_time < 500) return;
+  double seconds = (now - profiler_texts_time) / 1000.;
+  profiler_texts_time = now;
+  for (Text *text : profiler_texts) delete text;
+  profiler_texts.clear();
+  const int frames = 30;
+  double total = ProfileAverageMs(PROFILE_NO_PHASE, frames);
+  profiler_texts.push_back(new Text(format("frame %.2f ms", total), {255, 255, 128, 0}, {64, 64, 0, 0}));
+  for (int i = 0; i < PROFILE_PHASE_COUNT; ++i) {
+    double ms = ProfileAverageMs(ProfilePhase(i), frames);
+    profiler_texts.push_back(new Text(format("%s %.2f ms", profile_phase_names[i], ms), {230, 230, 230, 0},
+                                      {60, 60, 60, 0}));
+  }
+  // Memory per subsystem: held now, peak and allocation rate.
+  for (int i = 0; i < MEMORY_TAG_COUNT; ++i) {
+    MemoryStats s = GetMemoryStats(MemoryTag(i));
+    double rate = seconds < 10 ? (s.allocated - profiler_memory_allocated[i]) / seconds : 0;
+    profiler_memory_allocated[i] = s.allocated;
+    profiler_texts.push_back(new Text(format("%s %s (peak %s) %s/s", memory_tag_names[i], FormatBytes(s.current).c_str(),
+                                             FormatBytes(s.peak).c_str(), FormatBytes(rate).c_str()),
+                                      {180, 210, 255, 0}, {40, 50, 70, 0}));
+  }
+}
+
+void DrawProfiler(int x, int y) {
+  UpdateProfilerTexts();
+
+  // Frame time graph - one bar per frame, stacked by phase. The line marks 60 FPS.
+  const int graph_w = PROFILE_HISTORY * 2, graph_h = 100;
+  const double ms_per_px = 33.3 / graph_h;
+  SDL_Rect graph_rect = {x, y, graph_w, graph_h};
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+  SDL_RenderFillRect(renderer, &graph_rect);
+  for (int i = 0; i < profile_history_size; ++i) {
+    const ProfileFrame &frame = ProfileRecentFrame(i);
+    SDL_Rect bar = {x + graph_w - 2 * (i + 1), y + graph_h, 2, 0};
+    int total_h = min(graph_h, int(frame.total_ns / 1e6 / ms_per_px));
+    bar.y -= total_h;
+    bar.h = total_h;
+    SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
+    SDL_RenderFillRect(renderer, &bar);
+    int bottom = y + graph_h;
+    for (int phase = 0; phase < PROFILE_PHASE_COUNT && bottom > y; ++phase) {
+      int h = min(bottom - y, int(frame.phase_ns[phase] / 1e6 / ms_per_px));
+      if (h == 0) continue;
+      SDL_Rect part = {bar.x, bottom - h, 2, h};
+      SDL_SetRenderDrawColor(renderer, Uint8(80 + phase * 97 % 176), Uint8(80 + phase * 53 % 176),
+                             Uint8(80 + phase * 151 % 176), 255);
+      SDL_RenderFillRect(renderer, &part);
+      bottom -= h;
+    }
+  }
+  SDL_SetRenderDrawColor(renderer, 255, 64, 64, 255);
+  int line_y = y + graph_h - int(16.7 / ms_per_px);
+  SDL_RenderDrawLine(renderer, x, line_y, x + graph_w, line_y);
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+  SDL_SetRenderDrawColor(renderer, 64, 0, 0, 255);
+
+  y += graph_h;
+  for (Text *text : profiler_texts) {
+    text->size.x = x;
+    text->size.y = y;
+    SDL_RenderCopy(renderer, text->texture, nullptr, &text->size);
+    y += text->size.h - 6;
+  }
+}
+
+void WakeRenderer() {
+  SDL_Event event = {};
+  event.type = wake_event_type;
+  SDL_PushEvent(&event);
+}
+
+// Picks up the newest simulation frame and speech. Returns true if the screen needs redrawing.
+bool UpdateRenderState() {
+  render_frames.Update();
+  const RenderFrame &frame = render_frames.Front();
+  // A minimap behind the structures only needs a redraw once its throttle lets it rebuild -
+  // the loop wakes up for that within HandleInput()'s timeout.
+  if (frame.world_hash != drawn_hash || frame.money != drawn_money || frame.cells_version != drawn_cells_version ||
+      MinimapDue(frame, SDL_GetTicks()))
+    redraw_needed = true;
+  SpeechEvent speech;
+  while (speech_events.Pop(speech)) {
+    auto &said = said_texts[speech.dwarf_id];
+    if (speech.text) {
+      said.push_back(new Text(speech.text, {230, 230, 230, 0}, {60, 60, 60, 0}));
+    } else if (!said.empty()) {
+      delete said.front();
+      said.pop_front();
+    }
+    redraw_needed = true;
+  }
+  return redraw_needed || show_profiler;
 }
 
 void Draw() {
+  const RenderFrame &frame = render_frames.Front();
+  redraw_needed = false;
+  drawn_hash = frame.world_hash;
+  drawn_money = frame.money;
+  drawn_cells_version = frame.cells_version;
   SDL_RenderClear(renderer);
 
   SDL_Rect tile_rect;
@@ -329,106 +657,154 @@ void Draw() {
   int bottom = top + int(windowRect.h / scale);
   Cell top_left = Cell(Point(top, left));
   Cell bottom_right = Cell(Point(bottom, right));
+  // Plans and items are only drawn close up - further out, their chunks may stay evicted.
+  if (scale >= lod_tile_scale)
+    SetPagingView(ChunkOf(top_left), ChunkOf(bottom_right));
+  else
+    SetPagingView(Cell(0, 0), Cell(-1, -1));
 
   // Draw cells & plans
-  for (int row = top_left.row; row <= bottom_right.row; ++row) {
-    for (int col = top_left.col; col <= bottom_right.col; ++col) {
-      Cell cell = {row, col};
-      SDL_Texture *texture = GetTextureForCell(cell);
-      GetTileRect(row, col, &tile_rect);
-      SDL_RenderCopy(renderer, texture, nullptr, &tile_rect);
-
-      auto it = plans.find(cell);
-      if (it != plans.end()) {
-        int orig_h = tile_rect.h;
-        tile_rect.h *= 1 - it->second->progress;
-        SDL_Rect source_rect = {0, 0, W, int(H * (1 - it->second->progress))};
-        SDL_Texture *structure_texture = GetTextureForStructureType(it->second->structure_type);
-        SDL_SetTextureAlphaMod(structure_texture, 64);
-        SDL_SetTextureBlendMode(structure_texture, SDL_BLENDMODE_BLEND);
-        SDL_RenderCopy(renderer, structure_texture, &source_rect, &tile_rect);
-        SDL_SetTextureBlendMode(structure_texture, SDL_BLENDMODE_NONE);
-        source_rect.y = source_rect.h;
-        source_rect.h = H - source_rect.h;
-        tile_rect.y += tile_rect.h;
-        tile_rect.h = orig_h - tile_rect.h;
-        SDL_RenderCopy(renderer, structure_texture, &source_rect, &tile_rect);
-        tile_rect.h = orig_h;
-        //SDL_SetTextureAlphaMod(structure_texture, 255);
+  {
+    ScopedTimer timer(PROFILE_DRAW_TILES);
+    if (scale < lod_tile_scale) {
+      DrawChunkSummaries(frame, top_left, bottom_right);
+    } else {
+      for (int row = top_left.row; row <= bottom_right.row; ++row) {
+        for (int col = top_left.col; col <= bottom_right.col; ++col) {
+          Cell cell = {row, col};
+          SDL_Texture *texture = GetTextureForCell(frame, cell);
+          GetTileRect(row, col, &tile_rect);
+          SDL_RenderCopy(renderer, texture, nullptr, &tile_rect);
+
+          auto it = frame.plans.find(cell);
+          if (it != frame.plans.end()) {
+            ScopedTimer plan_timer(PROFILE_DRAW_PLANS);
+            int orig_h = tile_rect.h;
+            tile_rect.h *= 1 - it->second.progress;
+            SDL_Rect source_rect = {0, 0, W, int(H * (1 - it->second.progress))};
+            SDL_Texture *structure_texture = GetTextureForStructureType(it->second.structure_type);
+            SDL_SetTextureAlphaMod(structure_texture, 64);
+            SDL_SetTextureBlendMode(structure_texture, SDL_BLENDMODE_BLEND);
+            SDL_RenderCopy(renderer, structure_texture, &source_rect, &tile_rect);
+            SDL_SetTextureBlendMode(structure_texture, SDL_BLENDMODE_NONE);
+            source_rect.y = source_rect.h;
+            source_rect.h = H - source_rect.h;
+            tile_rect.y += tile_rect.h;
+            tile_rect.h = orig_h - tile_rect.h;
+            SDL_RenderCopy(renderer, structure_texture, &source_rect, &tile_rect);
+            tile_rect.h = orig_h;
+            //SDL_SetTextureAlphaMod(structure_texture, 255);
+          }
+        }
       }
     }
   }
 
   // Draw dwarves
-  for (Dwarf *d:dwarves) {
-    SDL_Rect r;
-    GetEffectiveSDL_Rect(*d, &r);
-    SDL_RenderCopy(renderer, dwarf, nullptr, &r);
+  {
+    ScopedTimer timer(PROFILE_DRAW_DWARVES);
+    if (scale < lod_dwarf_scale) {
+      DrawDwarfDots(frame);
+    } else {
+      for (const RenderDwarf &d : frame.dwarves) {
+        SDL_Rect r;
+        GetEffectiveSDL_Rect(d, &r);
+        SDL_RenderCopy(renderer, dwarf, nullptr, &r);
+      }
+    }
   }
 
   // Draw items
-  for (int row = top_left.row; row <= bottom_right.row; ++row) {
-    for (int col = top_left.col; col <= bottom_right.col; ++col) {
-      Cell cell = {row, col};
-      auto range = items.equal_range(cell);
-      for (auto it = range.first; it != range.second; ++it) {
+  {
+    ScopedTimer timer(PROFILE_DRAW_ITEMS);
+    // Too small to see in the chunk view
+    if (scale >= lod_tile_scale) {
+      auto draw_item = [&](const Point &pos, ItemType type) {
+        Cell cell(pos);
+        if (cell.row < top_left.row || cell.row > bottom_right.row || cell.col < top_left.col ||
+            cell.col > bottom_right.col)
+          return;
         SDL_Rect rect;
-        rect.x = it->second->pos.x;
-        rect.y = it->second->pos.y;
-        rect.w = it->second->def->w;
-        rect.h = it->second->def->h;
-        SDL_RenderCopy(renderer, item_textures[it->second->def->type], nullptr, &rect);
-      }
+        rect.x = pos.x;
+        rect.y = pos.y;
+        rect.w = item_defs[type].w;
+        rect.h = item_defs[type].h;
+        SDL_RenderCopy(renderer, item_textures[type], nullptr, &rect);
+      };
+      for (const RenderItem &item : frame.items) draw_item(item.pos, item.type);
+      for (const RenderDwarf &d : frame.dwarves)
+        if (d.item != NO_ITEM_TYPE) draw_item(d.pos, d.item);
     }
   }
 
   // Draw text bubbles & interface
-  for (Dwarf *d:dwarves) {
-    SDL_Rect r;
-    GetEffectiveSDL_Rect(*d, &r);
-    Text *name_texture = name_texts[d];
-    name_texture->size.x = r.x + r.w / 2 - name_texture->size.w / 2;
-    name_texture->size.y = r.y - name_texture->size.h;
-    SDL_RenderCopy(renderer, name_texture->texture, nullptr, &name_texture->size);
-    int y = name_texture->size.y;
-    auto &said = said_texts[d];
-    int now = SDL_GetTicks();
-    while (!said.empty() && (now - said.front()->time_said > 5000)) {
-      delete said.front();
-      said.pop_front();
+  {
+    ScopedTimer timer(PROFILE_DRAW_LABELS);
+    if (scale >= lod_label_scale) {
+      for (const RenderDwarf &d : frame.dwarves) {
+        SDL_Rect r;
+        GetEffectiveSDL_Rect(d, &r);
+        Text *&name_texture = name_texts[d.id];
+        if (name_texture == nullptr) name_texture = new Text(d.name, {150, 255, 150, 0}, {20, 60, 20, 0});
+        name_texture->size.x = r.x + r.w / 2 - name_texture->size.w / 2;
+        name_texture->size.y = r.y - name_texture->size.h;
+        SDL_RenderCopy(renderer, name_texture->texture, nullptr, &name_texture->size);
+        int y = name_texture->size.y;
+        auto &said = said_texts[d.id];
+        for (Text *said_text : said) {
+          said_text->size.x = r.x + r.w / 2 - said_text->size.w / 2;
+          said_text->size.y = y - said_text->size.h;
+          y -= said_text->size.h;
+          SDL_RenderCopy(renderer, said_text->texture, nullptr, &said_text->size);
+        }
+      }
     }
-    for (SaidText *said_text : said) {
-      said_text->size.x = r.x + r.w / 2 - said_text->size.w / 2;
-      said_text->size.y = y - said_text->size.h;
-      y -= said_text->size.h;
-      SDL_RenderCopy(renderer, said_text->texture, nullptr, &said_text->size);
+    Text* money_text = GetMoneyText(frame);
+    money_text->size.x = 110;
+    money_text->size.y = 10;
+    SDL_RenderCopy(renderer, money_text->texture, nullptr, &money_text->size);
+    if (show_profiler) {
+      DrawProfiler(money_text->size.x + money_text->size.w + 20, 10);
     }
   }
-  Text* money_text = GetMoneyText();
-  money_text->size.x = 110;
-  money_text->size.y = 10;
-  SDL_RenderCopy(renderer, money_text->texture, nullptr, &money_text->size);
-
-  // Draw plan selection marker
-  if (active_command != COMMAND_SELECT) {
-    Cell c;
-    GetMouseCell(&c);
-    GetTileRect(c.row, c.col, &tile_rect);
-    SDL_RenderCopy(renderer, selection_texture, nullptr, &tile_rect);
-  }
 
-  // Draw buttons
-  SDL_Rect button_rect{
-      0, 0, 100, 100};
-  for (int i = 0; i < buttons.size(); ++i) {
-    button_rect.y = i * 100;
-    if (buttons[i] == active_button) {
-      SDL_SetTextureColorMod(buttons[i]->texture, 128, 128, 128);
-    } else {
-      SDL_SetTextureColorMod(buttons[i]->texture, 255, 255, 255);
+  {
+    ScopedTimer timer(PROFILE_DRAW_BUTTONS);
+    // Draw plan selection marker - over the visible part of the dragged area
+    if (fill_structure != NONE) {
+      for (int row = max(min(fill_start.row, fill_end.row), top_left.row);
+           row <= min(max(fill_start.row, fill_end.row), bottom_right.row); ++row) {
+        for (int col = max(min(fill_start.col, fill_end.col), top_left.col);
+             col <= min(max(fill_start.col, fill_end.col), bottom_right.col); ++col) {
+          GetTileRect(row, col, &tile_rect);
+          SDL_RenderCopy(renderer, selection_texture, nullptr, &tile_rect);
+        }
+      }
+    } else if (active_command != COMMAND_SELECT) {
+      Cell c;
+      GetMouseCell(&c);
+      marker_cell = c;
+      GetTileRect(c.row, c.col, &tile_rect);
+      SDL_RenderCopy(renderer, selection_texture, nullptr, &tile_rect);
+    }
+
+    DrawMinimap(frame);
+
+    // Draw buttons
+    SDL_Rect button_rect{
+        0, 0, 100, 100};
+    for (int i = 0; i < buttons.size(); ++i) {
+      button_rect.y = i * 100;
+      if (buttons[i] == active_button) {
+        SDL_SetTextureColorMod(buttons[i]->texture, 128, 128, 128);
+      } else {
+        SDL_SetTextureColorMod(buttons[i]->texture, 255, 255, 255);
+      }
+      SDL_RenderCopy(renderer, buttons[i]->texture, nullptr, &button_rect);
     }
-    SDL_RenderCopy(renderer, buttons[i]->texture, nullptr, &button_rect);
   }
+
+  ScopedTimer timer(PROFILE_PRESENT);
   SDL_RenderPresent(renderer);
 }
 
@@ -444,12 +820,14 @@ bool Init() {
     fprintf(stderr, "Failed to create window : %s\n", SDL_GetError());
     return false;
   }
-  dwarf_created.handlers.push_back([](Dwarf *dwarf) {
-    name_texts[dwarf] = new Text(dwarf->name, {150, 255, 150, 0}, {20, 60, 20, 0});
-    dwarf->said_something.handlers.push_back([dwarf](string *s) {
-      said_texts[dwarf].push_back(new SaidText(*s, {230, 230, 230, 0}, {60, 60, 60, 0}));
-    });
-  });
+  // Dwarves speak on the simulation thread - their words reach Draw() through a queue.
+  world.events.Subscribe(EVENT_DWARF_SAID, QueueSpeech);
+  world.events.Subscribe(EVENT_DWARF_SPEECH_ENDED, QueueSpeech);
+  wake_event_type = SDL_RegisterEvents(1);
+  wake_renderer = WakeRenderer;
+  // Decoders initialize themselves lazily - do it before the loading threads race for it.
+  IMG_Init(IMG_INIT_PNG);
+  asset_bundle.Open(asset_bundle_path);
   if (!InitRenderer()) return false;
   return true;
 }
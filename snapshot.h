@@ -0,0 +1,469 @@
+#ifndef BUNKERBUILDER_SNAPSHOT_H
+#define BUNKERBUILDER_SNAPSHOT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "game.h"
+
+/**
+ * Binary world snapshots.
+ *
+ * A snapshot is a header followed by flat arrays of fixed-size records. There are no
+ * pointers in the file - a dwarf refers to the item it carries by its index in the item
+ * array. Records are naturally aligned, so a loader can map the file and read the arrays in
+ * place without parsing.
+ *
+ * Layout (all sections 8-byte aligned, native byte order):
+ *   SnapshotHeader
+ *   SnapshotChunk[chunk_count]  - structure types of a 16x16 block of cells, 0 = ground
+ *   SnapshotPlan[plan_count]
+ *   SnapshotItem[item_count]    - sorted by cell, so items lying in one cell form a stack
+ *   SnapshotWorkshop[workshop_count] - stock and running batch of workshops, sorted by cell
+ *   dwarves, as separate arrays: pos_y, pos_x, item, name_offset, name_length, rng[4], id
+ *   dwarf names, concatenated
+ */
+
+namespace bb {
+
+using namespace std;
+
+constexpr uint32_t SNAPSHOT_VERSION = 4;
+constexpr int SNAPSHOT_CHUNK = 16;
+const char SNAPSHOT_MAGIC[8] = {'B', 'B', 'S', 'N', 'A', 'P', 0, 0};
+constexpr int SNAPSHOT_DWARF_FIELDS = 10; // 32-bit values per dwarf
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t chunk_size;
+  int64_t tick_number;
+  int64_t money;
+  int64_t next_dwarf_id;
+  uint32_t random_state[4]; // World::rng
+  uint64_t chunk_count, plan_count, item_count, dwarf_count, names_size;
+  uint64_t chunks_offset, plans_offset, items_offset, dwarves_offset, names_offset;
+  uint64_t workshop_count, workshops_offset;
+  uint64_t file_size;
+};
+
+struct SnapshotChunk {
+  int32_t row, col; // in chunks
+  uint8_t types[SNAPSHOT_CHUNK * SNAPSHOT_CHUNK];
+};
+
+struct SnapshotPlan {
+  int32_t row, col;
+  uint32_t structure_type;
+  uint32_t reserved;
+  double progress;
+};
+
+struct SnapshotItem {
+  int32_t y, x;
+  uint32_t type;
+  uint32_t reserved;
+};
+
+struct SnapshotWorkshop {
+  int32_t row, col;
+  uint16_t stock[RECIPE_SLOTS];
+  int64_t started;
+};
+
+uint64_t SnapshotAlign(uint64_t offset) {
+  return (offset + 7) & ~uint64_t(7);
+}
+
+template<class T>
+T *SnapshotArray(char *base, uint64_t offset) {
+  return reinterpret_cast<T *>(base + offset);
+}
+
+template<class T>
+const T *SnapshotArray(const char *base, uint64_t offset) {
+  return reinterpret_cast<const T *>(base + offset);
+}
+
+// Serializes the world into memory. This is the only part of saving that has to run on the
+// simulation thread. Evicted chunks are read back from the page file but stay evicted.
+vector<char> SerializeWorld(const World &w) {
+  // Stand-ins for the objects of evicted chunks. Reserved up front - the sorting below keeps
+  // pointers to them.
+  vector<pair<Cell, StructureType>> paged_structures;
+  vector<SnapshotWorkshop> workshops;
+  vector<Plan> paged_plans;
+  vector<Item> paged_items;
+  vector<pair<Cell, Plan *>> sorted_plans(w.plans.begin(), w.plans.end());
+  vector<pair<Cell, Item *>> sorted_items(w.items.begin(), w.items.end());
+  paged_plans.reserve(w.pager.plans);
+  paged_items.reserve(w.pager.items);
+  vector<char> record;
+  for (auto &p : w.pager.evicted) {
+    if (!ReadChunkRecord(w, p.second, record)) continue;
+    const ChunkRecord &header = *ChunkRecordArray<ChunkRecord>(record, 0);
+    const PagedStructure *structures = ChunkRecordArray<PagedStructure>(record, sizeof(ChunkRecord));
+    const PagedPlan *plans = reinterpret_cast<const PagedPlan *>(structures + header.structures);
+    const PagedItem *items = reinterpret_cast<const PagedItem *>(plans + header.plans);
+    for (uint32_t i = 0; i < header.structures; ++i) {
+      Cell cell(structures[i].row, structures[i].col);
+      paged_structures.emplace_back(cell, (StructureType) structures[i].type);
+      if (RecipeOf((StructureType) structures[i].type) == NO_RECIPE) continue;
+      SnapshotWorkshop out = {};
+      out.row = cell.row;
+      out.col = cell.col;
+      for (int k = 0; k < RECIPE_SLOTS; ++k) out.stock[k] = structures[i].stock[k];
+      out.started = structures[i].started;
+      workshops.push_back(out);
+    }
+    for (uint32_t i = 0; i < header.plans; ++i) {
+      paged_plans.emplace_back((StructureType) plans[i].structure_type);
+      paged_plans.back().progress = plans[i].progress;
+      sorted_plans.emplace_back(Cell(plans[i].row, plans[i].col), &paged_plans.back());
+    }
+    for (uint32_t i = 0; i < header.items; ++i) {
+      paged_items.emplace_back();
+      Item &item = paged_items.back();
+      item.def = &item_defs[items[i].type < NO_ITEM_TYPE ? items[i].type : 0];
+      item.pos = Point(items[i].y, items[i].x);
+      item.assignee = nullptr;
+      sorted_items.emplace_back(Cell(items[i].row, items[i].col), &item);
+    }
+  }
+
+  // Group structures into chunks.
+  unordered_map<Cell, size_t> chunk_index;
+  vector<SnapshotChunk> chunks;
+  auto add_structure = [&](const Cell &cell, StructureType type) {
+    Cell chunk_cell(div_floor(cell.row, SNAPSHOT_CHUNK), div_floor(cell.col, SNAPSHOT_CHUNK));
+    auto it = chunk_index.find(chunk_cell);
+    if (it == chunk_index.end()) {
+      it = chunk_index.insert(make_pair(chunk_cell, chunks.size())).first;
+      chunks.emplace_back();
+      SnapshotChunk &chunk = chunks.back();
+      chunk.row = chunk_cell.row;
+      chunk.col = chunk_cell.col;
+      memset(chunk.types, 0, sizeof(chunk.types));
+    }
+    int r = cell.row - chunk_cell.row * SNAPSHOT_CHUNK;
+    int c = cell.col - chunk_cell.col * SNAPSHOT_CHUNK;
+    chunks[it->second].types[r * SNAPSHOT_CHUNK + c] = (uint8_t) type;
+  };
+  for (auto &p : w.cells) add_structure(p.first, p.second->type);
+  for (auto &p : paged_structures) add_structure(p.first, p.second);
+  sort(chunks.begin(), chunks.end(), [](const SnapshotChunk &a, const SnapshotChunk &b) {
+    return Cell(a.row, a.col) < Cell(b.row, b.col);
+  });
+
+  sort(sorted_plans.begin(), sorted_plans.end(),
+       [](const pair<Cell, Plan *> &a, const pair<Cell, Plan *> &b) { return a.first < b.first; });
+
+  sort(sorted_items.begin(), sorted_items.end(), [](const pair<Cell, Item *> &a, const pair<Cell, Item *> &b) {
+    if (a.first != b.first) return a.first < b.first;
+    if (a.second->pos.y != b.second->pos.y) return a.second->pos.y < b.second->pos.y;
+    return a.second->pos.x < b.second->pos.x;
+  });
+  for (const WorkshopLane &lane : w.workshops) {
+    for (size_t i = 0; i < lane.structures.size(); ++i) {
+      SnapshotWorkshop out = {};
+      out.row = lane.cells[i].row;
+      out.col = lane.cells[i].col;
+      for (int k = 0; k < RECIPE_SLOTS; ++k) out.stock[k] = lane.stock[i][k];
+      out.started = lane.started[i];
+      workshops.push_back(out);
+    }
+  }
+  sort(workshops.begin(), workshops.end(), [](const SnapshotWorkshop &a, const SnapshotWorkshop &b) {
+    return Cell(a.row, a.col) < Cell(b.row, b.col);
+  });
+  unordered_map<Item *, int32_t> item_handles;
+  for (size_t i = 0; i < sorted_items.size(); ++i) item_handles[sorted_items[i].second] = (int32_t) i;
+
+  uint64_t names_size = 0;
+  for (Dwarf *d : w.dwarves) names_size += d->name.size();
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.chunk_size = SNAPSHOT_CHUNK;
+  header.tick_number = w.tick_number;
+  header.money = w.money;
+  header.next_dwarf_id = w.next_dwarf_id;
+  memcpy(header.random_state, w.rng.s, sizeof(header.random_state));
+  header.chunk_count = chunks.size();
+  header.plan_count = sorted_plans.size();
+  header.item_count = sorted_items.size();
+  header.dwarf_count = w.dwarves.size();
+  header.workshop_count = workshops.size();
+  header.names_size = names_size;
+  header.chunks_offset = SnapshotAlign(sizeof(SnapshotHeader));
+  header.plans_offset = SnapshotAlign(header.chunks_offset + header.chunk_count * sizeof(SnapshotChunk));
+  header.items_offset = SnapshotAlign(header.plans_offset + header.plan_count * sizeof(SnapshotPlan));
+  header.workshops_offset = SnapshotAlign(header.items_offset + header.item_count * sizeof(SnapshotItem));
+  header.dwarves_offset = SnapshotAlign(header.workshops_offset + header.workshop_count * sizeof(SnapshotWorkshop));
+  header.names_offset = SnapshotAlign(header.dwarves_offset + header.dwarf_count * SNAPSHOT_DWARF_FIELDS * sizeof(int32_t));
+  header.file_size = SnapshotAlign(header.names_offset + names_size);
+
+  vector<char> data(header.file_size, 0);
+  char *base = data.data();
+  memcpy(base, &header, sizeof(header));
+  if (!chunks.empty()) {
+    memcpy(base + header.chunks_offset, chunks.data(), chunks.size() * sizeof(SnapshotChunk));
+  }
+  SnapshotPlan *out_plans = SnapshotArray<SnapshotPlan>(base, header.plans_offset);
+  for (auto &p : sorted_plans) {
+    out_plans->row = p.first.row;
+    out_plans->col = p.first.col;
+    out_plans->structure_type = p.second->structure_type;
+    out_plans->progress = p.second->progress;
+    ++out_plans;
+  }
+  SnapshotItem *out_items = SnapshotArray<SnapshotItem>(base, header.items_offset);
+  for (auto &p : sorted_items) {
+    out_items->y = p.second->pos.y;
+    out_items->x = p.second->pos.x;
+    out_items->type = p.second->def->type;
+    ++out_items;
+  }
+  if (!workshops.empty()) {
+    memcpy(base + header.workshops_offset, workshops.data(), workshops.size() * sizeof(SnapshotWorkshop));
+  }
+  int32_t *pos_y = SnapshotArray<int32_t>(base, header.dwarves_offset);
+  int32_t *pos_x = pos_y + header.dwarf_count;
+  int32_t *item = pos_x + header.dwarf_count;
+  uint32_t *name_offset = reinterpret_cast<uint32_t *>(item + header.dwarf_count);
+  uint32_t *name_length = name_offset + header.dwarf_count;
+  uint32_t *rng = name_length + header.dwarf_count;
+  int32_t *id = reinterpret_cast<int32_t *>(rng + 4 * header.dwarf_count);
+  char *names = base + header.names_offset;
+  uint32_t offset = 0;
+  int i = 0;
+  for (Dwarf *d : w.dwarves) {
+    pos_y[i] = d->pos.y;
+    pos_x[i] = d->pos.x;
+    item[i] = d->item ? item_handles[d->item] : -1;
+    name_offset[i] = offset;
+    name_length[i] = (uint32_t) d->name.size();
+    for (int k = 0; k < 4; ++k) rng[k * header.dwarf_count + i] = d->rng.s[k];
+    id[i] = d->id;
+    memcpy(names + offset, d->name.data(), d->name.size());
+    offset += d->name.size();
+    ++i;
+  }
+  return data;
+}
+
+bool WriteSnapshotFile(const string &path, const vector<char> &data) {
+  string tmp_path = path + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s for writing\n", tmp_path.c_str());
+    return false;
+  }
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Failed to write snapshot %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool SaveSnapshot(const World &w, const string &path) {
+  return WriteSnapshotFile(path, SerializeWorld(w));
+}
+
+thread snapshot_writer;
+
+// Captures the world immediately and writes it to disk on a background thread.
+void SaveSnapshotAsync(const World &w, const string &path) {
+  vector<char> data = SerializeWorld(w);
+  if (snapshot_writer.joinable()) snapshot_writer.join();
+  snapshot_writer = thread([path](vector<char> data) { WriteSnapshotFile(path, data); }, move(data));
+}
+
+void FinishSnapshotWrites() {
+  if (snapshot_writer.joinable()) snapshot_writer.join();
+}
+
+bool SnapshotStructureType(uint32_t type) {
+  return type > NONE && type < sizeof(structure_defs) / sizeof(structure_defs[0]);
+}
+
+// Whether `count` records of `record_size` bytes at `offset` lie within the file.
+bool SnapshotSection(uint64_t offset, uint64_t count, uint64_t record_size, size_t size) {
+  return offset % 8 == 0 && offset <= size && count <= (size - offset) / record_size;
+}
+
+// Checks every section, name and type of a snapshot, so that BuildWorld() can read the file
+// without further checks.
+bool CheckSnapshot(const SnapshotHeader &header, const char *base, size_t size) {
+  if (!SnapshotSection(header.chunks_offset, header.chunk_count, sizeof(SnapshotChunk), size) ||
+      !SnapshotSection(header.plans_offset, header.plan_count, sizeof(SnapshotPlan), size) ||
+      !SnapshotSection(header.items_offset, header.item_count, sizeof(SnapshotItem), size) ||
+      !SnapshotSection(header.workshops_offset, header.workshop_count, sizeof(SnapshotWorkshop), size) ||
+      !SnapshotSection(header.dwarves_offset, header.dwarf_count, SNAPSHOT_DWARF_FIELDS * sizeof(int32_t), size) ||
+      header.names_offset > size || header.names_size > size - header.names_offset)
+    return false;
+  const SnapshotChunk *chunks = SnapshotArray<SnapshotChunk>(base, header.chunks_offset);
+  const int32_t max_chunk = INT32_MAX / SNAPSHOT_CHUNK - 1;
+  for (uint64_t i = 0; i < header.chunk_count; ++i) {
+    if (chunks[i].row < -max_chunk || chunks[i].row > max_chunk || chunks[i].col < -max_chunk ||
+        chunks[i].col > max_chunk)
+      return false;
+    for (uint8_t type : chunks[i].types)
+      if (type != NONE && !SnapshotStructureType(type)) return false;
+  }
+  const SnapshotWorkshop *workshops = SnapshotArray<SnapshotWorkshop>(base, header.workshops_offset);
+  for (uint64_t i = 0; i < header.workshop_count; ++i)
+    if (workshops[i].started < -1 || workshops[i].started > header.tick_number) return false;
+  const SnapshotPlan *plans = SnapshotArray<SnapshotPlan>(base, header.plans_offset);
+  for (uint64_t i = 0; i < header.plan_count; ++i)
+    if (!SnapshotStructureType(plans[i].structure_type)) return false;
+  const SnapshotItem *items = SnapshotArray<SnapshotItem>(base, header.items_offset);
+  for (uint64_t i = 0; i < header.item_count; ++i)
+    if (items[i].type >= NO_ITEM_TYPE) return false;
+  const uint32_t *name_offset = SnapshotArray<uint32_t>(base, header.dwarves_offset) + 3 * header.dwarf_count;
+  const uint32_t *name_length = name_offset + header.dwarf_count;
+  for (uint64_t i = 0; i < header.dwarf_count; ++i)
+    if (name_offset[i] > header.names_size || name_length[i] > header.names_size - name_offset[i]) return false;
+  // Dwarves are written in id order, and ids are below the next one to be given out.
+  if (header.next_dwarf_id < 0 || header.next_dwarf_id > INT32_MAX) return false;
+  const int32_t *id = reinterpret_cast<const int32_t *>(name_length + 5 * header.dwarf_count);
+  for (uint64_t i = 0; i < header.dwarf_count; ++i)
+    if (id[i] < (i ? id[i - 1] + 1 : 0) || id[i] >= header.next_dwarf_id) return false;
+  return true;
+}
+
+bool BuildWorld(World &w, const char *base, size_t size) {
+  if (size < sizeof(SnapshotHeader)) {
+    fprintf(stderr, "Snapshot too short\n");
+    return false;
+  }
+  const SnapshotHeader &header = *reinterpret_cast<const SnapshotHeader *>(base);
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "Not a snapshot file\n");
+    return false;
+  }
+  if (header.version != SNAPSHOT_VERSION || header.chunk_size != SNAPSHOT_CHUNK) {
+    fprintf(stderr, "Unsupported snapshot version %u\n", header.version);
+    return false;
+  }
+  if (header.file_size != size) {
+    fprintf(stderr, "Snapshot is truncated\n");
+    return false;
+  }
+  if (!CheckSnapshot(header, base, size)) {
+    fprintf(stderr, "Snapshot is corrupt\n");
+    return false;
+  }
+
+  ClearWorld(w);
+  w.tick_number = header.tick_number;
+  w.timers.Reset(w.tick_number);
+  w.money = (int) header.money;
+  w.next_dwarf_id = (int) header.next_dwarf_id;
+  memcpy(w.rng.s, header.random_state, sizeof(w.rng.s));
+
+  const SnapshotChunk *chunks = SnapshotArray<SnapshotChunk>(base, header.chunks_offset);
+  for (uint64_t i = 0; i < header.chunk_count; ++i) {
+    const SnapshotChunk &chunk = chunks[i];
+    for (int j = 0; j < SNAPSHOT_CHUNK * SNAPSHOT_CHUNK; ++j) {
+      if (chunk.types[j] == NONE) continue;
+      Cell cell(chunk.row * SNAPSHOT_CHUNK + j / SNAPSHOT_CHUNK, chunk.col * SNAPSHOT_CHUNK + j % SNAPSHOT_CHUNK);
+      Structure *structure = Structure::New((StructureType) chunk.types[j]);
+      if (structure) {
+        w.cells.insert(make_pair(cell, structure));
+        AddWorkshop(w, cell, structure);
+        LogStructureChange(w, cell);
+      }
+    }
+  }
+
+  const SnapshotWorkshop *in_workshops = SnapshotArray<SnapshotWorkshop>(base, header.workshops_offset);
+  for (uint64_t i = 0; i < header.workshop_count; ++i) {
+    auto it = w.cells.find(Cell(in_workshops[i].row, in_workshops[i].col));
+    if (it == w.cells.end() || it->second->workshop < 0) continue;
+    WorkshopLane &lane = w.workshops[RecipeOf(it->second->type)];
+    for (int k = 0; k < RECIPE_SLOTS; ++k) lane.stock[it->second->workshop][k] = in_workshops[i].stock[k];
+    lane.started[it->second->workshop] = in_workshops[i].started;
+  }
+
+  const SnapshotPlan *in_plans = SnapshotArray<SnapshotPlan>(base, header.plans_offset);
+  w.plans.reserve(header.plan_count);
+  for (uint64_t i = 0; i < header.plan_count; ++i) {
+    Plan *plan = NewPlan(w, (StructureType) in_plans[i].structure_type);
+    plan->progress = in_plans[i].progress;
+    w.plans.insert(make_pair(Cell(in_plans[i].row, in_plans[i].col), plan));
+  }
+
+  const SnapshotItem *in_items = SnapshotArray<SnapshotItem>(base, header.items_offset);
+  vector<Item *> item_handles(header.item_count);
+  w.items.reserve(header.item_count);
+  for (uint64_t i = 0; i < header.item_count; ++i) {
+    Item *item = new Item();
+    item->def = &item_defs[in_items[i].type];
+    item->pos = Point(in_items[i].y, in_items[i].x);
+    item->assignee = nullptr;
+    item->cell = Cell(item->pos);
+    w.items.insert(make_pair(item->cell, item));
+    item_handles[i] = item;
+  }
+
+  const int32_t *pos_y = SnapshotArray<int32_t>(base, header.dwarves_offset);
+  const int32_t *pos_x = pos_y + header.dwarf_count;
+  const int32_t *item = pos_x + header.dwarf_count;
+  const uint32_t *name_offset = reinterpret_cast<const uint32_t *>(item + header.dwarf_count);
+  const uint32_t *name_length = name_offset + header.dwarf_count;
+  const uint32_t *rng = name_length + header.dwarf_count;
+  const int32_t *id = reinterpret_cast<const int32_t *>(rng + 4 * header.dwarf_count);
+  const char *names = base + header.names_offset;
+  for (uint64_t i = 0; i < header.dwarf_count; ++i) {
+    Dwarf *d = new Dwarf();
+    d->id = id[i];
+    for (int k = 0; k < 4; ++k) d->rng.s[k] = rng[k * header.dwarf_count + i];
+    d->name.assign(names + name_offset[i], name_length[i]);
+    d->pos = Point(pos_y[i], pos_x[i]);
+    d->item = (item[i] >= 0 && item[i] < (int64_t) header.item_count) ? item_handles[item[i]] : nullptr;
+    w.dwarves.insert(d);
+    w.events.Post(WorldEvent{EVENT_DWARF_CREATED, d->id, nullptr});
+  }
+  RecomputeWorldHash(w);
+  return true;
+}
+
+bool LoadSnapshot(World &w, const string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open snapshot %s\n", path.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    fprintf(stderr, "Failed to stat snapshot %s\n", path.c_str());
+    return false;
+  }
+  void *mapped = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    fprintf(stderr, "Failed to map snapshot %s\n", path.c_str());
+    return false;
+  }
+  bool ok = BuildWorld(w, (const char *) mapped, (size_t) st.st_size);
+  munmap(mapped, (size_t) st.st_size);
+  return ok;
+}
+
+}
+
+#endif //BUNKERBUILDER_SNAPSHOT_H
@@ -0,0 +1,113 @@
+#ifndef BUNKERBUILDER_TELEMETRY_H
+#define BUNKERBUILDER_TELEMETRY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/**
+ * Search counters.
+ *
+ * Tick() fills the world's `tick_stats` from scratch and adds it to its `search_totals`.
+ * Both can be read from code after every tick, or dumped as CSV - one row per dwarf per
+ * tick - so that the distributions can be inspected offline.
+ */
+
+namespace bb {
+
+using namespace std;
+
+struct DwarfSearchStats {
+  int dwarf = -1; // Dwarf::id
+  int64_t nodes_expanded = 0;
+  int64_t queue_peak = 0; // frontier size seen while expanding this dwarf's nodes
+  int path_length = -1;   // steps to the job, -1 if no job was found
+  bool found_job = false;
+};
+
+struct SearchStats {
+  int64_t tick = 0;
+  vector<DwarfSearchStats> dwarves; // one per dwarf, by id - Tick() fills in the ids
+  int64_t frontier_peak = 0;
+  int jobs_found = 0;
+  int jobs_failed = 0;
+  int farm_jobs = 0; // dwarves working at a mushroom farm
+  int step_cap_hits = 0;
+  int64_t take_work_attempts = 0;
+  int64_t take_work_successes = 0;
+
+  // Keeps the capacity of `dwarves`, which Tick() refills every tick.
+  void Clear(int64_t _tick) {
+    vector<DwarfSearchStats> kept;
+    kept.swap(dwarves);
+    *this = SearchStats();
+    tick = _tick;
+    kept.clear();
+    dwarves.swap(kept);
+  }
+
+  DwarfSearchStats &ForDwarf(int id) {
+    return *lower_bound(dwarves.begin(), dwarves.end(), id,
+                        [](const DwarfSearchStats &d, int id) { return d.dwarf < id; });
+  }
+};
+
+struct SearchTotals {
+  int64_t ticks = 0;
+  int64_t nodes_expanded = 0;
+  int64_t frontier_peak = 0;
+  int64_t jobs_found = 0;
+  int64_t jobs_failed = 0;
+  int64_t farm_jobs = 0; // dwarf-ticks spent at mushroom farms
+  int64_t step_cap_hits = 0;
+  int64_t take_work_attempts = 0;
+  int64_t take_work_successes = 0;
+  int64_t path_length_sum = 0;
+
+  void Add(const SearchStats &stats) {
+    ++ticks;
+    for (const DwarfSearchStats &d : stats.dwarves) {
+      nodes_expanded += d.nodes_expanded;
+      if (d.found_job) path_length_sum += d.path_length;
+    }
+    frontier_peak = max(frontier_peak, stats.frontier_peak);
+    jobs_found += stats.jobs_found;
+    jobs_failed += stats.jobs_failed;
+    farm_jobs += stats.farm_jobs;
+    step_cap_hits += stats.step_cap_hits;
+    take_work_attempts += stats.take_work_attempts;
+    take_work_successes += stats.take_work_successes;
+  }
+
+  double TakeWorkSuccessRate() const {
+    return take_work_attempts ? double(take_work_successes) / take_work_attempts : 0;
+  }
+
+  // Share of dwarf-ticks in which the dwarf found nothing to do.
+  double IdleRatio() const {
+    return jobs_found + jobs_failed ? double(jobs_failed) / (jobs_found + jobs_failed) : 0;
+  }
+
+  double MeanPathLength() const {
+    return jobs_found ? double(path_length_sum) / jobs_found : 0;
+  }
+};
+
+void WriteSearchStatsCsvHeader(FILE *f) {
+  fprintf(f, "tick,dwarf,nodes_expanded,queue_peak,found_job,path_length,"
+             "frontier_peak,step_cap_hit,take_work_attempts,take_work_successes\n");
+}
+
+void WriteSearchStatsCsv(FILE *f, const SearchStats &stats) {
+  for (const DwarfSearchStats &d : stats.dwarves) {
+    fprintf(f, "%lld,%d,%lld,%lld,%d,%d,%lld,%d,%lld,%lld\n", (long long) stats.tick, d.dwarf,
+            (long long) d.nodes_expanded, (long long) d.queue_peak, d.found_job ? 1 : 0, d.path_length,
+            (long long) stats.frontier_peak, stats.step_cap_hits, (long long) stats.take_work_attempts,
+            (long long) stats.take_work_successes);
+  }
+}
+
+}
+
+#endif //BUNKERBUILDER_TELEMETRY_H
@@ -0,0 +1,159 @@
+#ifndef BUNKERBUILDER_TIMERS_H
+#define BUNKERBUILDER_TIMERS_H
+
+#include <cstdint>
+#include <vector>
+#include "events.h"
+
+/**
+ * Hierarchical timer wheel keyed on simulation ticks.
+ *
+ * A timer is a WorldEvent that gets posted to the world's EventBus at a given tick. Level 0
+ * has one slot per tick for the next 64 ticks, level 1 one slot per 64 ticks for the next
+ * 4096 and so on. When the wheel reaches the start of a slot on a higher level, the timers in
+ * it are redistributed to the lower levels - every timer is moved at most LEVELS times before
+ * it fires. Scheduling and cancelling are O(1) and a tick only touches timers that are due
+ * (or are being redistributed), so waiting timers cost nothing.
+ *
+ * Timers due at the same tick fire in the order in which they were scheduled.
+ */
+
+namespace bb {
+
+using namespace std;
+
+struct TimerId {
+  int32_t index = -1;
+  uint32_t generation = 0;
+};
+
+struct TimerWheel {
+  static const int BITS = 6;
+  static const int SLOTS = 1 << BITS;
+  static const int LEVELS = 4;
+  static const int NO_LIST = -1;
+
+  struct Timer {
+    int64_t due;
+    WorldEvent event;
+    int32_t prev, next;
+    int32_t list;
+    uint32_t generation;
+  };
+
+  vector<Timer> timers;
+  vector<int32_t> free_timers;
+  int32_t heads[LEVELS * SLOTS], tails[LEVELS * SLOTS];
+  int64_t now = 0; // last processed tick
+  int64_t active = 0;
+
+  TimerWheel() {
+    for (int i = 0; i < LEVELS * SLOTS; ++i) heads[i] = tails[i] = -1;
+  }
+
+  void Link(int32_t index, int32_t list) {
+    Timer &t = timers[index];
+    t.list = list;
+    t.next = -1;
+    t.prev = tails[list];
+    if (t.prev >= 0)
+      timers[t.prev].next = index;
+    else
+      heads[list] = index;
+    tails[list] = index;
+  }
+
+  void Unlink(int32_t index) {
+    Timer &t = timers[index];
+    if (t.prev >= 0) timers[t.prev].next = t.next; else heads[t.list] = t.next;
+    if (t.next >= 0) timers[t.next].prev = t.prev; else tails[t.list] = t.prev;
+    t.list = NO_LIST;
+  }
+
+  void Place(int32_t index) {
+    int64_t due = timers[index].due;
+    int64_t delta = due - now;
+    for (int level = 0; level < LEVELS; ++level) {
+      if (delta < (int64_t(1) << (BITS * (level + 1)))) {
+        Link(index, level * SLOTS + int((due >> (BITS * level)) & (SLOTS - 1)));
+        return;
+      }
+    }
+    // Further than the wheel reaches - park it in the top level, it will come around again.
+    Link(index, (LEVELS - 1) * SLOTS + int(((now >> (BITS * (LEVELS - 1))) - 1) & (SLOTS - 1)));
+  }
+
+  // Drops all timers and continues from `tick`.
+  void Reset(int64_t tick) {
+    *this = TimerWheel();
+    now = tick;
+  }
+
+  // `due` is a tick number. Timers for this tick or the past fire at the next processed tick.
+  TimerId Schedule(int64_t due, const WorldEvent &event) {
+    int32_t index;
+    if (free_timers.empty()) {
+      index = (int32_t) timers.size();
+      timers.push_back(Timer());
+    } else {
+      index = free_timers.back();
+      free_timers.pop_back();
+    }
+    Timer &t = timers[index];
+    t.due = due > now ? due : now + 1;
+    t.event = event;
+    Place(index);
+    ++active;
+    return TimerId{index, t.generation};
+  }
+
+  bool IsScheduled(TimerId id) const {
+    return id.index >= 0 && id.index < (int32_t) timers.size() && timers[id.index].generation == id.generation &&
+           timers[id.index].list != NO_LIST;
+  }
+
+  bool Cancel(TimerId id) {
+    if (!IsScheduled(id)) return false;
+    Release(id.index);
+    return true;
+  }
+
+  void Release(int32_t index) {
+    Unlink(index);
+    ++timers[index].generation;
+    free_timers.push_back(index);
+    --active;
+  }
+
+  // Processes all ticks up to `tick`, posting the events of due timers to `events`.
+  void Advance(int64_t tick, EventBus &events) {
+    while (now < tick) {
+      if (active == 0) {
+        now = tick;
+        return;
+      }
+      ++now;
+      for (int level = LEVELS - 1; level > 0; --level) {
+        if (now & ((int64_t(1) << (BITS * level)) - 1)) continue;
+        int list = level * SLOTS + int((now >> (BITS * level)) & (SLOTS - 1));
+        for (int32_t index = heads[list]; index >= 0;) {
+          int32_t next = timers[index].next;
+          Unlink(index);
+          Place(index);
+          index = next;
+        }
+      }
+      // Posting is deferred, so nothing can schedule into this slot while it's being emptied.
+      int list = int(now & (SLOTS - 1));
+      while (heads[list] >= 0) {
+        int32_t index = heads[list];
+        events.Post(timers[index].event);
+        Release(index);
+      }
+    }
+  }
+};
+
+}
+
+#endif //BUNKERBUILDER_TIMERS_H
@@ -0,0 +1,197 @@
+#ifndef BUNKERBUILDER_TRACE_H
+#define BUNKERBUILDER_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+/**
+ * Trace recorder producing Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+ *
+ * Every thread appends complete ("X") events to its own ring buffer. Only the owning thread
+ * writes to a ring, so recording takes no locks - the registry mutex is taken once per
+ * thread, when its ring is created. Rings keep the most recent events, so writing the trace
+ * at any moment captures the last few seconds before it - up to `trace_window_ns`, but only
+ * the newest TraceBuffer::SIZE events of each thread. A simulation thread recording a span
+ * per dwarf fills that in well under the window; WriteTrace() then reports how far back the
+ * thread's events reach. Rings are created on a thread's first event, so nothing is
+ * allocated unless tracing is on.
+ */
+
+namespace bb {
+
+using namespace std;
+
+struct TraceEvent {
+  const char *name; // must point to a string literal
+  int64_t ts_ns, dur_ns;
+  char label[24]; // optional per-event detail, e.g. a dwarf name
+  const char *arg_names[2];
+  int64_t args[2];
+};
+
+struct TraceBuffer {
+  static constexpr uint64_t SIZE = 1 << 15;
+  TraceEvent events[SIZE];
+  atomic<uint64_t> written{0};
+  int tid;
+  const char *thread_name = nullptr;
+};
+
+atomic<bool> trace_enabled{false};
+const chrono::steady_clock::time_point trace_epoch = chrono::steady_clock::now();
+string trace_path = "trace.json";
+// Only events that ended in the last `trace_window_ns` are written out.
+int64_t trace_window_ns = 10000000000LL;
+
+mutex trace_buffers_mutex;
+vector<TraceBuffer *> trace_buffers;
+thread_local TraceBuffer *trace_buffer = nullptr;
+thread_local const char *trace_thread_name = nullptr;
+
+int64_t TraceNow() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - trace_epoch).count();
+}
+
+int64_t TraceTime(chrono::steady_clock::time_point t) {
+  return chrono::duration_cast<chrono::nanoseconds>(t - trace_epoch).count();
+}
+
+TraceBuffer *GetTraceBuffer() {
+  if (trace_buffer == nullptr) {
+    // Buffers are never freed - their events must outlive the thread that wrote them.
+    trace_buffer = new TraceBuffer();
+    trace_buffer->thread_name = trace_thread_name;
+    lock_guard<mutex> lock(trace_buffers_mutex);
+    trace_buffer->tid = (int) trace_buffers.size() + 1;
+    trace_buffers.push_back(trace_buffer);
+  }
+  return trace_buffer;
+}
+
+void TraceThreadName(const char *name) {
+  trace_thread_name = name;
+  if (trace_buffer) trace_buffer->thread_name = name;
+}
+
+void StartTrace(const string &path) {
+  trace_path = path;
+  GetTraceBuffer();
+  trace_enabled = true;
+}
+
+void TraceComplete(const char *name, int64_t ts_ns, int64_t dur_ns, const char *label = nullptr,
+                   const char *arg0 = nullptr, int64_t val0 = 0, const char *arg1 = nullptr, int64_t val1 = 0) {
+  TraceBuffer *buffer = GetTraceBuffer();
+  uint64_t n = buffer->written.load(memory_order_relaxed);
+  TraceEvent &e = buffer->events[n % TraceBuffer::SIZE];
+  e.name = name;
+  e.ts_ns = ts_ns;
+  e.dur_ns = dur_ns;
+  if (label) {
+    strncpy(e.label, label, sizeof(e.label) - 1);
+    e.label[sizeof(e.label) - 1] = 0;
+  } else {
+    e.label[0] = 0;
+  }
+  e.arg_names[0] = arg0;
+  e.args[0] = val0;
+  e.arg_names[1] = arg1;
+  e.args[1] = val1;
+  buffer->written.store(n + 1, memory_order_release);
+}
+
+struct TraceScope {
+  const char *name;
+  int64_t start;
+
+  TraceScope(const char *_name) : name(trace_enabled ? _name : nullptr), start(name ? TraceNow() : 0) {}
+
+  ~TraceScope() {
+    if (name) TraceComplete(name, start, TraceNow() - start);
+  }
+};
+
+void WriteTraceString(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') fputc('\\', f);
+    if ((unsigned char) *s >= 0x20) fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+// Writes the recent events of all threads. Threads may keep tracing meanwhile - events
+// overwritten during the copy are dropped.
+bool WriteTrace(const string &path) {
+  FILE *f = fopen(path.c_str(), "w");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open trace file %s\n", path.c_str());
+    return false;
+  }
+  int64_t cutoff = TraceNow() - trace_window_ns;
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  vector<TraceEvent> copy;
+  lock_guard<mutex> lock(trace_buffers_mutex);
+  for (TraceBuffer *buffer : trace_buffers) {
+    uint64_t end = buffer->written.load(memory_order_acquire);
+    uint64_t begin = end > TraceBuffer::SIZE ? end - TraceBuffer::SIZE : 0;
+    copy.clear();
+    for (uint64_t i = begin; i < end; ++i) copy.push_back(buffer->events[i % TraceBuffer::SIZE]);
+    uint64_t now_written = buffer->written.load(memory_order_acquire);
+    // Event `now_written` may be going into the slot of now_written - SIZE as we speak.
+    uint64_t valid_from = now_written >= TraceBuffer::SIZE ? now_written - TraceBuffer::SIZE + 1 : 0;
+    if (valid_from > 0 && valid_from < end) {
+      const TraceEvent &oldest = copy[valid_from - begin];
+      if (oldest.ts_ns > cutoff)
+        fprintf(stderr, "Trace of thread %d covers only the last %.2f s (%llu events)\n", buffer->tid,
+                (TraceNow() - oldest.ts_ns) / 1e9, (unsigned long long) TraceBuffer::SIZE);
+    }
+    if (buffer->thread_name) {
+      fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":",
+              first ? "" : ",\n", buffer->tid);
+      WriteTraceString(f, buffer->thread_name);
+      fprintf(f, "}}");
+      first = false;
+    }
+    for (uint64_t i = max(begin, valid_from); i < end; ++i) {
+      const TraceEvent &e = copy[i - begin];
+      if (e.ts_ns + e.dur_ns < cutoff) continue;
+      fprintf(f, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":", first ? "" : ",\n",
+              buffer->tid, e.ts_ns / 1e3, e.dur_ns / 1e3);
+      WriteTraceString(f, e.name);
+      first = false;
+      if (e.label[0] == 0 && e.arg_names[0] == nullptr) {
+        fprintf(f, "}");
+        continue;
+      }
+      fprintf(f, ",\"args\":{");
+      const char *separator = "";
+      if (e.label[0]) {
+        fprintf(f, "\"label\":");
+        WriteTraceString(f, e.label);
+        separator = ",";
+      }
+      for (int a = 0; a < 2; ++a) {
+        if (e.arg_names[a] == nullptr) continue;
+        fprintf(f, "%s", separator);
+        WriteTraceString(f, e.arg_names[a]);
+        fprintf(f, ":%lld", (long long) e.args[a]);
+        separator = ",";
+      }
+      fprintf(f, "}}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  return true;
+}
+
+}
+
+#endif //BUNKERBUILDER_TRACE_H
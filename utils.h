@@ -3,8 +3,13 @@
 
 #include <cstdarg>
 #include <sstream>
+#include <string>
+#include <vector>
 
 namespace bb {
+
+using namespace std;
+
 template<class T>
 T div_floor(T x, T y) {
   T q = x / y;
@@ -48,17 +53,6 @@ string format(string fmt, ...) {
   }
 }
 
-template<class T>
-struct Event {
-  vector<function<void(T *t)>> handlers;
-
-  void run(T *t) {
-    for (auto &handler : handlers) {
-      handler(t);
-    }
-  }
-};
-
 struct EnumClassHash {
   template<typename T>
   std::size_t operator()(T t) const {
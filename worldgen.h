@@ -0,0 +1,147 @@
+#ifndef BUNKERBUILDER_WORLDGEN_H
+#define BUNKERBUILDER_WORLDGEN_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "game.h"
+#include "random.h"
+
+/**
+ * Procedural bunker generator for stress & soak testing.
+ *
+ * Staircase shafts go down from the surface every few columns. Every few rows a level of
+ * corridors branches off the shafts that reach it, and some of the branches end in a
+ * mushroom farm. Spores are scattered over the surface and the corridors, dwarves are put
+ * in random reachable cells and open plans extend the network at its edges.
+ *
+ * The layout depends only on the parameters, so a spec like
+ * "rows=2000,cols=4000,dwarves=500" names the same bunker everywhere. Dwarves take their
+ * streams from the world generator as usual.
+ */
+
+namespace bb {
+
+using namespace std;
+
+struct WorldGenParams {
+  uint64_t seed = 1;
+  int rows = 64; // underground rows, below the surface
+  int cols = 256;
+  int dwarves = 16;
+  int plans = 64;
+  int spores = 128;
+  int farm_percent = 15; // chance for a corridor branch to end in a farm
+};
+
+// Parses comma-separated key=value pairs on top of the defaults.
+bool ParseWorldGenParams(const string &spec, WorldGenParams &params) {
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == string::npos) end = spec.size();
+    string item = spec.substr(start, end - start);
+    start = end + 1;
+    char key[32];
+    unsigned long long value;
+    if (sscanf(item.c_str(), "%31[^=]=%llu", key, &value) != 2) {
+      fprintf(stderr, "Malformed world generator option: %s\n", item.c_str());
+      return false;
+    }
+    if (strcmp(key, "seed") == 0) params.seed = value;
+    else if (strcmp(key, "rows") == 0) params.rows = (int) value;
+    else if (strcmp(key, "cols") == 0) params.cols = (int) value;
+    else if (strcmp(key, "dwarves") == 0) params.dwarves = (int) value;
+    else if (strcmp(key, "plans") == 0) params.plans = (int) value;
+    else if (strcmp(key, "spores") == 0) params.spores = (int) value;
+    else if (strcmp(key, "farm_percent") == 0) params.farm_percent = (int) value;
+    else {
+      fprintf(stderr, "Unknown world generator option: %s\n", key);
+      return false;
+    }
+  }
+  if (params.rows < 1 || params.cols < 1) {
+    fprintf(stderr, "World generator needs at least one row and column\n");
+    return false;
+  }
+  return true;
+}
+
+string FormatWorldGenParams(const WorldGenParams &p) {
+  return format("seed=%llu,rows=%d,cols=%d,dwarves=%d,plans=%d,spores=%d,farm_percent=%d",
+                (unsigned long long) p.seed, p.rows, p.cols, p.dwarves, p.plans, p.spores, p.farm_percent);
+}
+
+// Replaces the contents of `w` with a generated bunker.
+void GenerateWorld(World &w, const WorldGenParams &p) {
+  ClearWorld(w);
+  random::Rng rng(p.seed);
+  vector<Cell> network;
+  auto place = [&](int row, int col, StructureType type) {
+    Cell cell(row, col);
+    if (w.cells.count(cell)) return false;
+    AddStructure(w, row, col, Structure::New(type));
+    network.push_back(cell);
+    return true;
+  };
+
+  // Shafts
+  vector<pair<int, int>> shafts; // column, depth
+  for (int col = (int) rng.Below(6); col < p.cols; col += 6 + (int) rng.Below(15)) {
+    int depth = p.rows / 3 + (int) rng.Below((uint32_t) (p.rows - p.rows / 3)) + 1;
+    shafts.push_back(make_pair(col, depth));
+    for (int row = 1; row <= depth; ++row) place(row, col, STAIRCASE);
+  }
+
+  // Levels
+  for (int row = 1 + (int) rng.Below(3); row <= p.rows; row += 2 + (int) rng.Below(4)) {
+    for (auto &shaft : shafts) {
+      if (shaft.second < row || rng.Below(4) == 0) continue;
+      for (int dir = -1; dir <= 1; dir += 2) {
+        int length = (int) rng.Below(12);
+        int col = shaft.first + dir;
+        for (int i = 0; i < length && col >= 0 && col < p.cols; ++i, col += dir)
+          place(row, col, CORRIDOR);
+        if (length > 0 && col >= 0 && col < p.cols && (int) rng.Below(100) < p.farm_percent)
+          place(row, col, MUSHROOM_FARM);
+      }
+    }
+  }
+
+  auto random_cell = [&]() {
+    // Half on the surface, half underground (if there is anything underground)
+    if (network.empty() || rng.Below(2) == 0) return Cell(0, (int) rng.Below((uint32_t) p.cols));
+    return network[rng.Below((uint32_t) network.size())];
+  };
+
+  const ItemDef &spore = item_defs[SPORE];
+  for (int i = 0; i < p.spores; ++i) {
+    Cell cell = random_cell();
+    AddItem(w, Point(cell.row * H + H / 2, cell.col * W + (int) rng.Below(W - spore.w)), SPORE);
+  }
+
+  // Plans continue the network sideways (corridors & farms) or downwards (staircases).
+  int placed = 0;
+  for (int attempt = 0; placed < p.plans && !network.empty() && attempt < p.plans * 8; ++attempt) {
+    Cell from = network[rng.Below((uint32_t) network.size())];
+    uint32_t dir = rng.Below(3);
+    Cell to = dir == 0 ? Cell(from.row + 1, from.col) : Cell(from.row, from.col + (dir == 1 ? -1 : 1));
+    if (to.row > p.rows || to.col < 0 || to.col >= p.cols) continue;
+    if (w.cells.count(to) || HasPlan(w, to)) continue;
+    if (dir == 0 && !IsStructureType(w, from, STAIRCASE)) continue;
+    StructureType type = dir == 0 ? STAIRCASE : rng.Below(4) == 0 ? MUSHROOM_FARM : CORRIDOR;
+    TogglePlan(w, to, type);
+    ++placed;
+  }
+
+  for (int i = 0; i < p.dwarves; ++i) {
+    Cell cell = random_cell();
+    AddDwarf(w, Dwarf::MakeRandom(w, cell.row, cell.col));
+  }
+}
+
+}
+
+#endif //BUNKERBUILDER_WORLDGEN_H